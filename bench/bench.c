@@ -0,0 +1,255 @@
+// SPDX-License-Identifier: MIT
+//
+// Runs the phases of a set workload and reports, for each of them,
+// the time and the hardware counters per operation:
+//
+//    insert         n distinct keys in an empty set, resizes included
+//    contains-hit   the n keys
+//    contains-miss  n keys that are not in the set
+//    resize         the full set to twice its capacity, per key
+//    remove         the n keys
+//
+// With -l, every operation is timed instead, or one every -S, and the
+// latencies are reported as percentiles per operation type. The
+// workload then also churns the set, removing old keys and inserting
+// new ones, so that misses run over tombstones. Operations slower than
+// -o nanoseconds are attributed to a resize if the table changed
+// during them, to tombstones if their probe crossed many of them, or
+// to something else like page faults or preemption.
+//
+// Usage: bench [-n keys] [-s seed] [-l] [-S every] [-o outlier_ns]
+//
+// bench/bench_bg is the same benchmark built with
+// HASHSET_BACKGROUND_RESIZE, to compare the two resize modes.
+//
+// The counters need perf_event_open(2), see perf_event_paranoid(5)
+// if they are missing from the output.
+
+#include "bench.h"
+
+HASHSET_DECLARE(u64, uint64_t, bench_hash_u64, bench_eq_u64)
+
+// Probes that cross at least this many tombstones are tombstone-heavy
+#define BENCH_TOMBSTONE_HEAVY 16
+
+enum {
+  OP_INSERT,
+  OP_CONTAINS_HIT,
+  OP_CONTAINS_MISS,
+  OP_REMOVE,
+  OPS,
+};
+
+static const char *op_names[OPS] = {
+  "insert", "contains-hit", "contains-miss", "remove",
+};
+
+enum {
+  CAUSE_RESIZE,
+  CAUSE_TOMBSTONES,
+  CAUSE_OTHER,
+  CAUSES,
+};
+
+static const char *cause_names[CAUSES] = {
+  "resize", "tombstones", "other",
+};
+
+typedef struct {
+  bench_hist ops[OPS];
+  uint64_t outlier_ns;
+  uint64_t every;
+  uint64_t n; // operations seen
+  uint64_t outliers[CAUSES];
+  uint64_t outlier_max[CAUSES];
+} latency;
+
+// Tombstones on the probe of [key], which stops where [key] is
+static size_t probe_tombstones(u64_set *set, uint64_t key)
+{
+  size_t mask = set->capacity - 1;
+  size_t idx = bench_hash_u64(key, sizeof(uint64_t)) & mask;
+  size_t tombstones = 0;
+  for (size_t n = 0; n < set->capacity; ++n, idx = (idx + 1) & mask)
+  {
+    if (set->state[idx] == 0) break;
+    if (set->state[idx] == 2) tombstones++;
+    else if (set->data[idx].val == key) break;
+  }
+  return tombstones;
+}
+
+static bool run_op(u64_set *set, int op, uint64_t key)
+{
+  switch (op)
+  {
+  case OP_INSERT:
+    return u64_set_insert(set, key, sizeof(uint64_t));
+  case OP_REMOVE:
+    return u64_set_remove(set, key, sizeof(uint64_t));
+  default:
+    return u64_set_contains(set, key, sizeof(uint64_t));
+  }
+}
+
+// Changes whenever a resize starts or ends
+static bool same_tables(u64_set *set, u64_set *before)
+{
+#ifdef HASHSET_BACKGROUND_RESIZE
+  if (set->bg.running != before->bg.running) return false;
+#endif
+  return set->data == before->data;
+}
+
+static bool timed_op(latency *lat, u64_set *set, int op, uint64_t key)
+{
+  if (lat->n++ % lat->every) return run_op(set, op, key);
+
+  u64_set before = *set;
+  uint64_t start = bench_now_ns();
+  bool ret = run_op(set, op, key);
+  uint64_t ns = bench_now_ns() - start;
+  bench_hist_add(&lat->ops[op], ns);
+  if (ns < lat->outlier_ns) return ret;
+
+  int cause = CAUSE_OTHER;
+  if (!same_tables(set, &before))
+    cause = CAUSE_RESIZE;
+  else if (probe_tombstones(set, key) >= BENCH_TOMBSTONE_HEAVY)
+    cause = CAUSE_TOMBSTONES;
+  lat->outliers[cause]++;
+  if (ns > lat->outlier_max[cause]) lat->outlier_max[cause] = ns;
+  return ret;
+}
+
+static int run_latency(uint64_t *keys, uint64_t *misses, size_t n,
+                       uint64_t every, uint64_t outlier_ns)
+{
+  latency *lat = calloc(1, sizeof(latency));
+  if (!lat) return 1;
+  lat->every = every ? every : 1;
+  lat->outlier_ns = outlier_ns;
+
+  u64_set set;
+  if (u64_set_init(&set) != HASHSET_OK) return 1;
+
+  size_t found = 0;
+  for (size_t i = 0; i < n; ++i)
+    timed_op(lat, &set, OP_INSERT, keys[i]);
+  for (size_t i = 0; i < n; ++i)
+    found += timed_op(lat, &set, OP_CONTAINS_HIT, keys[i]);
+  for (size_t i = 0; i < n / 2; ++i)
+  {
+    found += timed_op(lat, &set, OP_REMOVE, keys[i]);
+    timed_op(lat, &set, OP_INSERT, misses[i]);
+  }
+  for (size_t i = n / 2; i < n; ++i)
+    found += timed_op(lat, &set, OP_CONTAINS_MISS, misses[i]);
+  if (found != n + n / 2) fprintf(stderr, "found %zu keys\n", found);
+
+  bench_hist_report_header();
+  for (int op = 0; op < OPS; ++op)
+    bench_hist_report(op_names[op], &lat->ops[op]);
+
+  printf("\noutliers above %llu ns\n", (unsigned long long) outlier_ns);
+  for (int cause = 0; cause < CAUSES; ++cause)
+    printf("%-14s %10llu  max %llu ns\n", cause_names[cause],
+           (unsigned long long) lat->outliers[cause],
+           (unsigned long long) lat->outlier_max[cause]);
+
+  u64_set_destroy(&set);
+  free(lat);
+  return 0;
+}
+
+static int run_counters(uint64_t *keys, uint64_t *misses, size_t n)
+{
+  bench_perf perf;
+  bench_perf_open(&perf);
+  if (!bench_perf_any(&perf))
+    fprintf(stderr, "perf_event_open failed, reporting time only\n");
+  bench_report_header(&perf);
+
+  u64_set set;
+  if (u64_set_init(&set) != HASHSET_OK) return 1;
+
+  bench_sample sample;
+  size_t found = 0;
+
+  bench_start(&perf, &sample);
+  for (size_t i = 0; i < n; ++i)
+    u64_set_insert(&set, keys[i], sizeof(uint64_t));
+  bench_stop(&perf, &sample);
+  bench_report(&perf, "insert", &sample, n);
+
+  bench_start(&perf, &sample);
+  for (size_t i = 0; i < n; ++i)
+    found += u64_set_contains(&set, keys[i], sizeof(uint64_t));
+  bench_stop(&perf, &sample);
+  bench_report(&perf, "contains-hit", &sample, n);
+
+  bench_start(&perf, &sample);
+  for (size_t i = 0; i < n; ++i)
+    found += u64_set_contains(&set, misses[i], sizeof(uint64_t));
+  bench_stop(&perf, &sample);
+  bench_report(&perf, "contains-miss", &sample, n);
+
+  bench_start(&perf, &sample);
+  u64_set_resize(&set, set.capacity * 2);
+  u64_set_resize_wait(&set);
+  bench_stop(&perf, &sample);
+  bench_report(&perf, "resize", &sample, set.size);
+
+  bench_start(&perf, &sample);
+  for (size_t i = 0; i < n; ++i)
+    found += u64_set_remove(&set, keys[i], sizeof(uint64_t));
+  bench_stop(&perf, &sample);
+  bench_report(&perf, "remove", &sample, n);
+
+  // Keeps the lookups from being optimized away
+  if (found != 2 * n) fprintf(stderr, "found %zu keys\n", found);
+
+  u64_set_destroy(&set);
+  bench_perf_close(&perf);
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  size_t n = 1000000;
+  uint64_t seed = 42;
+  bool latency_mode = false;
+  uint64_t every = 1;
+  uint64_t outlier_ns = 10000;
+  for (int i = 1; i < argc; ++i)
+  {
+    if (!strcmp(argv[i], "-n") && i + 1 < argc)
+      n = bench_parse_size(argv[++i]);
+    else if (!strcmp(argv[i], "-s") && i + 1 < argc)
+      seed = strtoull(argv[++i], NULL, 10);
+    else if (!strcmp(argv[i], "-l"))
+      latency_mode = true;
+    else if (!strcmp(argv[i], "-S") && i + 1 < argc)
+      every = strtoull(argv[++i], NULL, 10);
+    else if (!strcmp(argv[i], "-o") && i + 1 < argc)
+      outlier_ns = strtoull(argv[++i], NULL, 10);
+    else
+    {
+      fprintf(stderr, "usage: %s [-n keys] [-s seed] [-l] [-S every]"
+              " [-o outlier_ns]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  uint64_t *keys = bench_keys(n, seed);
+  uint64_t *misses = bench_keys(n, ~seed);
+  if (!keys || !misses) return 1;
+
+  int ret = latency_mode
+    ? run_latency(keys, misses, n, every, outlier_ns)
+    : run_counters(keys, misses, n);
+
+  free(keys);
+  free(misses);
+  return ret;
+}
@@ -0,0 +1,484 @@
+// SPDX-License-Identifier: MIT
+//
+// Helpers shared by the benchmarks in this directory: a clock, the
+// hardware counters read with perf_event_open(2) on Linux, latency
+// histograms, the memory seen by the kernel or allocated by the sets,
+// the keys used by the workloads and the traces of HASHSET_TRACE.
+//
+// Include this before anything else, it needs _GNU_SOURCE. With
+// BENCH_COUNT_ALLOCS defined, the sets allocate through a counting
+// allocator that tracks the bytes they hold.
+
+#ifndef _HASHSET_BENCH_H_
+#define _HASHSET_BENCH_H_
+
+#ifndef _GNU_SOURCE
+  #define _GNU_SOURCE
+#endif
+
+#include <stddef.h>
+
+#ifdef BENCH_COUNT_ALLOCS
+  static void *bench_calloc(size_t n, size_t size);
+  static void bench_free(void *ptr);
+  #define HASHSET_CALLOC bench_calloc
+  #define HASHSET_FREE bench_free
+#endif
+
+#include "../hashset.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef __linux__
+  #include <linux/perf_event.h>
+  #include <sys/ioctl.h>
+  #include <sys/syscall.h>
+  #include <unistd.h>
+#endif
+
+//
+// Clock
+//
+
+static inline uint64_t bench_now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+//
+// Hardware counters
+//
+
+enum {
+  BENCH_INSTRUCTIONS,
+  BENCH_CYCLES,
+  BENCH_BRANCH_MISSES,
+  BENCH_CACHE_MISSES,
+  BENCH_DTLB_MISSES,
+  BENCH_COUNTERS,
+};
+
+static const char *bench_counter_names[BENCH_COUNTERS] = {
+  "instr", "cycles", "br-miss", "cache-miss", "dtlb-miss",
+};
+
+typedef struct {
+  int fd[BENCH_COUNTERS]; // -1 if the counter is not available
+} bench_perf;
+
+// A measured phase of a workload
+typedef struct {
+  uint64_t ns;
+  uint64_t count[BENCH_COUNTERS];
+} bench_sample;
+
+// Opens the counters of the calling thread, the ones the kernel or
+// the hardware do not allow are left closed
+static inline void bench_perf_open(bench_perf *perf)
+{
+  for (int i = 0; i < BENCH_COUNTERS; ++i)
+    perf->fd[i] = -1;
+
+#ifdef __linux__
+  static const struct { uint32_t type; uint64_t config; } events[] = {
+    [BENCH_INSTRUCTIONS] =
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    [BENCH_CYCLES] =
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    [BENCH_BRANCH_MISSES] =
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    [BENCH_CACHE_MISSES] =
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    [BENCH_DTLB_MISSES] =
+      {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB
+                           | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+                           | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+  };
+
+  for (int i = 0; i < BENCH_COUNTERS; ++i)
+  {
+    struct perf_event_attr attr = {0};
+    attr.size = sizeof(attr);
+    attr.type = events[i].type;
+    attr.config = events[i].config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    perf->fd[i] = (int) syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+  }
+#endif
+}
+
+static inline bool bench_perf_any(bench_perf *perf)
+{
+  for (int i = 0; i < BENCH_COUNTERS; ++i)
+    if (perf->fd[i] >= 0) return true;
+  return false;
+}
+
+static inline void bench_perf_close(bench_perf *perf)
+{
+#ifdef __linux__
+  for (int i = 0; i < BENCH_COUNTERS; ++i)
+    if (perf->fd[i] >= 0) close(perf->fd[i]);
+#endif
+  for (int i = 0; i < BENCH_COUNTERS; ++i)
+    perf->fd[i] = -1;
+}
+
+static inline void bench_start(bench_perf *perf, bench_sample *sample)
+{
+  *sample = (bench_sample){0};
+#ifdef __linux__
+  for (int i = 0; i < BENCH_COUNTERS; ++i)
+  {
+    if (perf->fd[i] < 0) continue;
+    ioctl(perf->fd[i], PERF_EVENT_IOC_RESET, 0);
+    ioctl(perf->fd[i], PERF_EVENT_IOC_ENABLE, 0);
+  }
+#else
+  (void) perf;
+#endif
+  sample->ns = bench_now_ns();
+}
+
+static inline void bench_stop(bench_perf *perf, bench_sample *sample)
+{
+  sample->ns = bench_now_ns() - sample->ns;
+#ifdef __linux__
+  for (int i = 0; i < BENCH_COUNTERS; ++i)
+  {
+    if (perf->fd[i] < 0) continue;
+    ioctl(perf->fd[i], PERF_EVENT_IOC_DISABLE, 0);
+    if (read(perf->fd[i], &sample->count[i], sizeof(uint64_t))
+        != sizeof(uint64_t))
+      sample->count[i] = 0;
+  }
+#else
+  (void) perf;
+#endif
+}
+
+static inline void bench_report_header(bench_perf *perf)
+{
+  printf("%-14s %10s", "phase", "ns/op");
+  for (int i = 0; i < BENCH_COUNTERS; ++i)
+    if (perf->fd[i] >= 0)
+      printf(" %12s", bench_counter_names[i]);
+  if (perf->fd[BENCH_INSTRUCTIONS] >= 0 && perf->fd[BENCH_CYCLES] >= 0)
+    printf(" %6s", "ipc");
+  printf("\n");
+}
+
+// Prints [sample] divided by the [ops] it took
+static inline void bench_report(bench_perf *perf,
+                                const char *phase,
+                                bench_sample *sample,
+                                size_t ops)
+{
+  double n = ops ? (double) ops : 1;
+  printf("%-14s %10.2f", phase, sample->ns / n);
+  for (int i = 0; i < BENCH_COUNTERS; ++i)
+    if (perf->fd[i] >= 0)
+      printf(" %12.3f", sample->count[i] / n);
+  if (perf->fd[BENCH_INSTRUCTIONS] >= 0 && perf->fd[BENCH_CYCLES] >= 0)
+    printf(" %6.2f", sample->count[BENCH_CYCLES]
+           ? (double) sample->count[BENCH_INSTRUCTIONS]
+             / sample->count[BENCH_CYCLES]
+           : 0.0);
+  printf("\n");
+}
+
+//
+// Latency histograms
+//
+
+// Log-linear buckets like HdrHistogram: values below 32 have their
+// own bucket, larger ones 32 buckets per power of two (3% precision)
+#define BENCH_HIST_SUB 32
+#define BENCH_HIST_BUCKETS (60 * BENCH_HIST_SUB)
+
+typedef struct {
+  uint64_t count[BENCH_HIST_BUCKETS];
+  uint64_t n;
+  uint64_t max;
+} bench_hist;
+
+static inline unsigned int bench_hist_bucket(uint64_t value)
+{
+  if (value < BENCH_HIST_SUB) return (unsigned int) value;
+  unsigned int e = 63 - (unsigned int) __builtin_clzll(value);
+  return (e - 4) * BENCH_HIST_SUB
+    + (unsigned int) ((value >> (e - 5)) & (BENCH_HIST_SUB - 1));
+}
+
+// Smallest value that goes in [bucket]
+static inline uint64_t bench_hist_value(unsigned int bucket)
+{
+  if (bucket < BENCH_HIST_SUB) return bucket;
+  unsigned int e = bucket / BENCH_HIST_SUB + 4;
+  return (uint64_t) (BENCH_HIST_SUB + bucket % BENCH_HIST_SUB) << (e - 5);
+}
+
+static inline void bench_hist_add(bench_hist *hist, uint64_t value)
+{
+  hist->count[bench_hist_bucket(value)]++;
+  hist->n++;
+  if (value > hist->max) hist->max = value;
+}
+
+// Value below which [p] of the recorded values are, 0 <= p <= 1
+static inline uint64_t bench_hist_percentile(bench_hist *hist, double p)
+{
+  uint64_t rank = (uint64_t) (p * hist->n + 0.5);
+  if (rank == 0) rank = 1;
+  uint64_t seen = 0;
+  for (unsigned int b = 0; b < BENCH_HIST_BUCKETS; ++b)
+  {
+    seen += hist->count[b];
+    if (seen >= rank)
+    {
+      uint64_t value = bench_hist_value(b + 1) - 1;
+      return value < hist->max ? value : hist->max;
+    }
+  }
+  return hist->max;
+}
+
+static inline void bench_hist_report_header(void)
+{
+  printf("%-14s %10s %10s %10s %10s %10s\n",
+         "op (ns)", "count", "p50", "p99", "p99.9", "max");
+}
+
+static inline void bench_hist_report(const char *op, bench_hist *hist)
+{
+  if (!hist->n) return;
+  printf("%-14s %10llu %10llu %10llu %10llu %10llu\n", op,
+         (unsigned long long) hist->n,
+         (unsigned long long) bench_hist_percentile(hist, 0.5),
+         (unsigned long long) bench_hist_percentile(hist, 0.99),
+         (unsigned long long) bench_hist_percentile(hist, 0.999),
+         (unsigned long long) hist->max);
+}
+
+//
+// Memory
+//
+
+// Resident set size in bytes, 0 if unknown
+static inline size_t bench_rss(void)
+{
+  size_t rss = 0;
+#ifdef __linux__
+  FILE *f = fopen("/proc/self/statm", "r");
+  if (!f) return 0;
+  unsigned long size, resident;
+  if (fscanf(f, "%lu %lu", &size, &resident) == 2)
+    rss = (size_t) resident * (size_t) sysconf(_SC_PAGESIZE);
+  fclose(f);
+#endif
+  return rss;
+}
+
+// Peak resident set size in bytes since the last bench_rss_peak_reset,
+// 0 if unknown
+static inline size_t bench_rss_peak(void)
+{
+  size_t peak = 0;
+#ifdef __linux__
+  FILE *f = fopen("/proc/self/status", "r");
+  if (!f) return 0;
+  char line[128];
+  unsigned long kb;
+  while (fgets(line, sizeof(line), f))
+    if (sscanf(line, "VmHWM: %lu kB", &kb) == 1)
+      peak = (size_t) kb * 1024;
+  fclose(f);
+#endif
+  return peak;
+}
+
+#ifdef BENCH_COUNT_ALLOCS
+
+// Keeps the size of each block before it, aligned for any type
+typedef union {
+  size_t size;
+  long double ld;
+  long long ll;
+  void *ptr;
+} bench_alloc_header;
+
+// Bytes allocated by the sets, now and at most since it was last reset
+static size_t bench_alloc_live;
+static size_t bench_alloc_peak;
+
+static void *bench_calloc(size_t n, size_t size)
+{
+  if (size && n > (SIZE_MAX - sizeof(bench_alloc_header)) / size)
+    return NULL;
+  bench_alloc_header *h = calloc(1, sizeof(bench_alloc_header) + n * size);
+  if (!h) return NULL;
+  h->size = n * size;
+  bench_alloc_live += h->size;
+  if (bench_alloc_live > bench_alloc_peak)
+    bench_alloc_peak = bench_alloc_live;
+  return h + 1;
+}
+
+static void bench_free(void *ptr)
+{
+  if (!ptr) return;
+  bench_alloc_header *h = (bench_alloc_header *) ptr - 1;
+  bench_alloc_live -= h->size;
+  free(h);
+}
+
+#endif // BENCH_COUNT_ALLOCS
+
+// Brings the peak back to the current resident set size, returns
+// false if the kernel does not allow it, see proc(5) clear_refs
+static inline bool bench_rss_peak_reset(void)
+{
+#ifdef __linux__
+  FILE *f = fopen("/proc/self/clear_refs", "w");
+  if (!f) return false;
+  bool ok = fputs("5", f) >= 0;
+  return fclose(f) == 0 && ok;
+#else
+  return false;
+#endif
+}
+
+//
+// Keys
+//
+
+static inline hashset_hash_t bench_hash_u64(uint64_t key,
+                                            unsigned int key_len)
+{
+  (void) key_len;
+  key = (key ^ (key >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  key = (key ^ (key >> 27)) * 0x94d049bb133111ebULL;
+  return (hashset_hash_t) (key ^ (key >> 31));
+}
+
+static inline bool bench_eq_u64(uint64_t a, unsigned int a_len,
+                                uint64_t b, unsigned int b_len)
+{
+  (void) a_len;
+  (void) b_len;
+  return a == b;
+}
+
+// [n] distinct random keys, different for each [seed]
+static inline uint64_t *bench_keys(size_t n, uint64_t seed)
+{
+  uint64_t *keys = malloc(n * sizeof(uint64_t));
+  if (!keys) return NULL;
+  for (size_t i = 0; i < n; ++i)
+    keys[i] = hashset_rand(&seed);
+  return keys;
+}
+
+static inline size_t bench_parse_size(const char *arg)
+{
+  char *end;
+  unsigned long long n = strtoull(arg, &end, 10);
+  if (*end == 'k') n *= 1000;
+  if (*end == 'M') n *= 1000000;
+  return (size_t) n;
+}
+
+//
+// Traces
+//
+
+// A recorded call, followed by the bytes of its key
+typedef struct {
+  uint64_t hash;
+  uint32_t key_len;
+  uint8_t op;
+  uint8_t result;
+  unsigned char key[];
+} bench_call;
+
+typedef struct {
+  char *calls;
+  size_t len;    // number of calls
+  size_t stride; // bytes between two calls
+  size_t key_size;
+} bench_trace;
+
+static inline const bench_call *bench_trace_call(const bench_trace *trace,
+                                                 size_t i)
+{
+  return (const bench_call *) (trace->calls + i * trace->stride);
+}
+
+// Reads the trace recorded with HASHSET_TRACE at [path], returns
+// non zero and prints why if it can not
+static inline int bench_trace_load(const char *path, bench_trace *trace)
+{
+  FILE *f = fopen(path, "rb");
+  if (!f)
+  {
+    perror(path);
+    return 1;
+  }
+
+  hashset_trace_header header;
+  if (fread(&header, sizeof(header), 1, f) != 1
+      || header.magic != HASHSET_TRACE_MAGIC
+      || header.version != HASHSET_TRACE_VERSION)
+  {
+    fprintf(stderr, "%s: not a hashset trace\n", path);
+    fclose(f);
+    return 1;
+  }
+
+  *trace = (bench_trace) {
+    .key_size = header.key_size,
+    .stride = HASHSET_ALIGN_UP(sizeof(bench_call) + header.key_size,
+                               sizeof(uint64_t)),
+  };
+  size_t cap = 0;
+  hashset_trace_record record;
+  while (fread(&record, sizeof(record), 1, f) == 1)
+  {
+    if (trace->len == cap)
+    {
+      cap = cap ? cap * 2 : 4096;
+      char *calls = realloc(trace->calls, cap * trace->stride);
+      if (!calls)
+      {
+        fprintf(stderr, "%s: out of memory\n", path);
+        free(trace->calls);
+        fclose(f);
+        return 1;
+      }
+      trace->calls = calls;
+    }
+    bench_call *c = (bench_call *) (trace->calls
+                                    + trace->len * trace->stride);
+    c->hash = record.hash;
+    c->key_len = record.key_len;
+    c->op = record.op;
+    c->result = record.result;
+    if (record.op < HASHSET_TRACE_INSERT
+        || record.op > HASHSET_TRACE_REMOVE
+        || fread(c->key, 1, trace->key_size, f) != trace->key_size)
+      break;
+    trace->len++;
+  }
+  if (!feof(f)) fprintf(stderr, "%s: truncated trace\n", path);
+  fclose(f);
+  return 0;
+}
+
+#endif // _HASHSET_BENCH_H_
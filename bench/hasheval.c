@@ -0,0 +1,356 @@
+// SPDX-License-Identifier: MIT
+//
+// Measures the speed and the quality of hash functions, as the sets
+// see them, truncated to hashset_hash_t:
+//
+//    throughput    bytes per cycle, or per ns without the cycle
+//                  counter, for each key length the function takes
+//    avalanche     how often each output bit flips when one input bit
+//                  does, 0.5 is ideal, worst is the farthest from it
+//    buckets       pairs of keys in the same bucket under & mask,
+//                  relative to a uniform hash, 1.00 is ideal
+//    probes        average linear probes of hits and misses at 0.5,
+//                  0.7 and 0.9 load, and what a uniform hash expects
+//
+// The quality is measured on n keys of a key set: "seq" are the
+// integers from 0, "rand" random integers and "text" the integers
+// written in decimal. Functions that take only 4 byte keys see the
+// integers truncated to 32 bits and skip the text keys.
+//
+// Usage: hasheval [-n keys] [-k seq|rand|text] [-s seed] [-f name]
+//
+// Other hash functions are compiled in with a header that defines
+// them like hashset_hash_char and lists them in HASHEVAL_USER_HASHES:
+//
+//    // myhashes.h
+//    static hashset_hash_t fnv1a(char *bytes, unsigned int len) { ... }
+//    #define HASHEVAL_USER_HASHES(X) X(fnv1a)
+//
+//    make -B bench/hasheval BENCH_DEFS=-DHASHEVAL_USER=$PWD/myhashes.h
+
+#define HASHSET_IMPLEMENTATION
+#include "bench.h"
+
+#define HASHEVAL_STR(x) HASHEVAL_STR_(x)
+#define HASHEVAL_STR_(x) #x
+
+#ifdef HASHEVAL_USER
+  #include HASHEVAL_STR(HASHEVAL_USER)
+#endif
+
+typedef hashset_hash_t (*hasheval_fn)(char *bytes, unsigned int len);
+
+typedef struct {
+  const char *name;
+  hasheval_fn fn;
+  unsigned int key_len; // 0 if the function takes any length
+} hasheval_hash;
+
+//
+// Hash functions
+//
+
+static hashset_hash_t hash_char(char *bytes, unsigned int len)
+{
+  return (hashset_hash_t) hashset_hash_char(bytes, len);
+}
+
+static hashset_hash_t hash_int32(char *bytes, unsigned int len)
+{
+  uint32_t key;
+  memcpy(&key, bytes, sizeof(key));
+  return (hashset_hash_t) hashset_hash_int32(key, len);
+}
+
+static hashset_hash_t hash_bytes(char *bytes, unsigned int len)
+{
+  return (hashset_hash_t) hashset_hash_bytes(bytes, len);
+}
+
+static hashset_hash_t hash_u64(char *bytes, unsigned int len)
+{
+  uint64_t key;
+  memcpy(&key, bytes, sizeof(key));
+  return bench_hash_u64(key, len);
+}
+
+#define HASHEVAL_USER_HASH(fn) {#fn, fn, 0},
+
+static const hasheval_hash hashes[] = {
+  {"hashset_hash_char", hash_char, 0},
+  {"hashset_hash_int32", hash_int32, 4},
+  {"hashset_hash_bytes", hash_bytes, 0},
+  {"bench_hash_u64", hash_u64, 8},
+#ifdef HASHEVAL_USER_HASHES
+  HASHEVAL_USER_HASHES(HASHEVAL_USER_HASH)
+#endif
+};
+
+#define HASHES (sizeof(hashes) / sizeof(hashes[0]))
+
+//
+// Keys
+//
+
+enum {
+  KEYS_SEQ,
+  KEYS_RAND,
+  KEYS_TEXT,
+};
+
+static const char *key_set_names[] = {"seq", "rand", "text"};
+
+#define KEY_MAX 24
+
+typedef struct {
+  char bytes[KEY_MAX];
+  unsigned int len;
+} key;
+
+// The [i]th key of [key_set] for [hash], false if it does not take it
+static bool make_key(const hasheval_hash *hash, int key_set,
+                     uint64_t i, uint64_t seed, key *k)
+{
+  uint64_t value = i;
+  switch (key_set)
+  {
+  case KEYS_TEXT:
+    if (hash->key_len) return false;
+    k->len = (unsigned int) snprintf(k->bytes, KEY_MAX, "%llu",
+                                     (unsigned long long) i);
+    return true;
+  case KEYS_RAND:
+    seed += i * 0x9e3779b97f4a7c15ULL;
+    value = hashset_rand(&seed);
+    break;
+  }
+  k->len = hash->key_len ? hash->key_len : sizeof(uint64_t);
+  memcpy(k->bytes, &value, k->len);
+  return true;
+}
+
+//
+// Throughput
+//
+
+static void eval_throughput(const hasheval_hash *hash, bench_perf *perf)
+{
+  static const unsigned int lens[] = {4, 8, 16, 32, 64, 256, 1024};
+  enum { BUF = 1 << 16 };
+  static char buf[BUF];
+  uint64_t seed = 1;
+  for (size_t i = 0; i < BUF; ++i)
+    buf[i] = (char) hashset_rand(&seed);
+
+  bool cycles = perf->fd[BENCH_CYCLES] >= 0;
+  printf("  throughput  %s:", cycles ? "bytes/cycle" : "bytes/ns");
+  for (size_t l = 0; l < sizeof(lens) / sizeof(lens[0]); ++l)
+  {
+    unsigned int len = lens[l];
+    if (hash->key_len && hash->key_len != len) continue;
+
+    size_t calls = ((size_t) 64 << 20) / len;
+    if (calls < (1 << 16)) calls = 1 << 16;
+    hashset_hash_t sink = 0;
+    bench_sample sample;
+    bench_start(perf, &sample);
+    for (size_t i = 0; i < calls; ++i)
+      sink ^= hash->fn(buf + (i * 64) % (BUF - len), len);
+    bench_stop(perf, &sample);
+
+    // Keeps the calls from being optimized away
+    if (sink == 1) fprintf(stderr, " ");
+    double per = cycles ? (double) sample.count[BENCH_CYCLES]
+                        : (double) sample.ns;
+    printf(" %u:%.2f", len, per ? (double) calls * len / per : 0.0);
+  }
+  printf("\n");
+}
+
+//
+// Avalanche
+//
+
+static void eval_avalanche(const hasheval_hash *hash, uint64_t seed)
+{
+  enum { SAMPLES = 2000 };
+  unsigned int len = hash->key_len ? hash->key_len : 8;
+  unsigned int in_bits = len * 8;
+  unsigned int out_bits = HASHSET_HASH_BITS;
+  uint32_t *flips = calloc((size_t) in_bits * out_bits, sizeof(uint32_t));
+  if (!flips) return;
+
+  for (unsigned int s = 0; s < SAMPLES; ++s)
+  {
+    char bytes[8];
+    for (unsigned int b = 0; b < len; ++b)
+      bytes[b] = (char) hashset_rand(&seed);
+    hashset_hash_t h = hash->fn(bytes, len);
+    for (unsigned int i = 0; i < in_bits; ++i)
+    {
+      bytes[i / 8] ^= (char) (1 << (i % 8));
+      hashset_hash_t diff = h ^ hash->fn(bytes, len);
+      bytes[i / 8] ^= (char) (1 << (i % 8));
+      for (unsigned int o = 0; o < out_bits; ++o)
+        flips[i * out_bits + o] += (diff >> o) & 1;
+    }
+  }
+
+  double sum = 0, worst = 0.5;
+  for (unsigned int i = 0; i < in_bits * out_bits; ++i)
+  {
+    double p = (double) flips[i] / SAMPLES;
+    sum += p;
+    if ((p - 0.5) * (p - 0.5) > (worst - 0.5) * (worst - 0.5)) worst = p;
+  }
+  printf("  avalanche   %u byte keys: mean %.3f, worst %.3f\n", len,
+         sum / (in_bits * out_bits), worst);
+  free(flips);
+}
+
+//
+// Distribution
+//
+
+static hashset_hash_t *key_hashes(const hasheval_hash *hash, int key_set,
+                                  size_t n, uint64_t seed)
+{
+  hashset_hash_t *h = malloc(n * sizeof(hashset_hash_t));
+  if (!h) return NULL;
+  for (size_t i = 0; i < n; ++i)
+  {
+    key k;
+    if (!make_key(hash, key_set, i, seed, &k))
+    {
+      free(h);
+      return NULL;
+    }
+    h[i] = hash->fn(k.bytes, k.len);
+  }
+  return h;
+}
+
+static void eval_buckets(hashset_hash_t *h, size_t n)
+{
+  printf("  buckets    ");
+  for (unsigned int bits = 8; bits <= 24; bits += 4)
+  {
+    size_t buckets = (size_t) 1 << bits;
+    uint32_t *count = calloc(buckets, sizeof(uint32_t));
+    if (!count) return;
+    for (size_t i = 0; i < n; ++i)
+      count[h[i] & (buckets - 1)]++;
+    double pairs = 0;
+    for (size_t b = 0; b < buckets; ++b)
+      pairs += (double) count[b] * (count[b] - 1) / 2;
+    double expected = (double) n * (n - 1) / 2 / buckets;
+    printf(" %u bits:%.2f", bits, expected ? pairs / expected : 0.0);
+    free(count);
+  }
+  printf("\n");
+}
+
+// Linear probing like prefix_set, in the largest table that the keys
+// can fill to [load]
+static void eval_probes(hashset_hash_t *h, size_t n, double load)
+{
+  size_t capacity = 16;
+  while (capacity * 2 * 0.9 <= n) capacity *= 2;
+  size_t used = (size_t) (capacity * load);
+  if (used > n) used = n;
+  uint8_t *full = calloc(capacity, 1);
+  if (!full) return;
+
+  size_t mask = capacity - 1;
+  double hit = 0;
+  for (size_t i = 0; i < used; ++i)
+  {
+    size_t idx = h[i] & mask, probes = 1;
+    while (full[idx]) idx = (idx + 1) & mask, probes++;
+    full[idx] = 1;
+    hit += probes;
+  }
+
+  // A miss is as likely to start in any slot, and probes up to the
+  // end of the cluster it starts in
+  double miss = 0;
+  size_t start = 0;
+  while (full[start]) start++;
+  for (size_t s = 0, run = 0; s < capacity; ++s)
+  {
+    size_t idx = (start + capacity - s) & mask;
+    run = full[idx] ? run + 1 : 0;
+    miss += run + 1;
+  }
+
+  double a = (double) used / capacity;
+  printf("  probes      load %.1f: hit %.2f (%.2f) miss %.2f (%.2f)\n",
+         load, used ? hit / used : 0.0, (1 + 1 / (1 - a)) / 2,
+         miss / capacity, (1 + 1 / ((1 - a) * (1 - a))) / 2);
+  free(full);
+}
+
+static int usage(const char *prog)
+{
+  fprintf(stderr, "usage: %s [-n keys] [-k seq|rand|text] [-s seed]"
+          " [-f name]\n", prog);
+  return 1;
+}
+
+int main(int argc, char **argv)
+{
+  size_t n = 1000000;
+  int key_set = KEYS_SEQ;
+  uint64_t seed = 42;
+  const char *only = NULL;
+  for (int i = 1; i < argc; ++i)
+  {
+    if (!strcmp(argv[i], "-n") && i + 1 < argc)
+      n = bench_parse_size(argv[++i]);
+    else if (!strcmp(argv[i], "-k") && i + 1 < argc)
+    {
+      const char *name = argv[++i];
+      key_set = -1;
+      for (int k = KEYS_SEQ; k <= KEYS_TEXT; ++k)
+        if (!strcmp(name, key_set_names[k])) key_set = k;
+      if (key_set < 0) return usage(argv[0]);
+    }
+    else if (!strcmp(argv[i], "-s") && i + 1 < argc)
+      seed = strtoull(argv[++i], NULL, 10);
+    else if (!strcmp(argv[i], "-f") && i + 1 < argc)
+      only = argv[++i];
+    else
+      return usage(argv[0]);
+  }
+  if (n < 2) n = 2;
+
+  bench_perf perf;
+  bench_perf_open(&perf);
+  if (perf.fd[BENCH_CYCLES] < 0)
+    fprintf(stderr, "perf_event_open failed, reporting bytes/ns\n");
+
+  for (size_t f = 0; f < HASHES; ++f)
+  {
+    const hasheval_hash *hash = &hashes[f];
+    if (only && strcmp(only, hash->name)) continue;
+
+    printf("%s\n", hash->name);
+    eval_throughput(hash, &perf);
+    eval_avalanche(hash, seed);
+
+    hashset_hash_t *h = key_hashes(hash, key_set, n, seed);
+    if (!h)
+    {
+      printf("  no %s keys\n", key_set_names[key_set]);
+      continue;
+    }
+    eval_buckets(h, n);
+    eval_probes(h, n, 0.5);
+    eval_probes(h, n, 0.7);
+    eval_probes(h, n, 0.9);
+    free(h);
+  }
+
+  bench_perf_close(&perf);
+  return 0;
+}
@@ -0,0 +1,170 @@
+// SPDX-License-Identifier: MIT
+//
+// Inserts n keys in each kind of set and reports the memory it takes
+// per entry:
+//
+//    bytes/entry   allocated at the end, the steady state
+//    peak/entry    allocated at the worst moment, old and new tables
+//                  both alive during a resize
+//    rss/entry     growth of the resident set size, calloc'd pages
+//                  that were never touched are not counted
+//    peak-rss      growth of the peak resident set size
+//
+// The allocations are counted with BENCH_COUNT_ALLOCS.
+// Other configurations are measured by rebuilding the tool, and
+// bench/memory_bg is built with HASHSET_BACKGROUND_RESIZE:
+//
+//    make -B bench/memory BENCH_DEFS=-DHASHSET_MAX_LOAD_FACTOR=0.9
+//
+// Usage: memory [-n keys] [-s seed]
+//
+// The peak resident set size needs /proc/self/clear_refs, the column
+// is missing if the kernel does not allow to reset it.
+
+#ifndef _GNU_SOURCE
+  #define _GNU_SOURCE
+#endif
+
+#define BENCH_COUNT_ALLOCS
+#include "bench.h"
+
+#ifdef __GLIBC__
+  #include <malloc.h>
+#endif
+
+//
+// Layouts
+//
+
+HASHSET_DECLARE(u64, uint64_t, bench_hash_u64, bench_eq_u64)
+HASHSET_DECLARE_U128(u128)
+HASHSET_DECLARE_POINTER(ptr)
+HASHSET_DECLARE_PERSISTENT(p64, uint64_t, bench_hash_u64, bench_eq_u64)
+
+typedef struct {
+  size_t live;
+  size_t rss;
+  size_t rss_peak;
+  bool has_rss_peak;
+} memory_mark;
+
+static void memory_begin(memory_mark *mark)
+{
+  mark->live = bench_alloc_live;
+  bench_alloc_peak = bench_alloc_live;
+  mark->rss = bench_rss();
+  mark->has_rss_peak = bench_rss_peak_reset();
+  mark->rss_peak = bench_rss_peak();
+}
+
+static void memory_report(const char *layout, memory_mark *mark,
+                          size_t entries)
+{
+  double n = entries ? (double) entries : 1;
+  size_t rss = bench_rss();
+  printf("%-12s %10zu %12.2f %12.2f %12.2f", layout, entries,
+         (bench_alloc_live - mark->live) / n,
+         (bench_alloc_peak - mark->live) / n,
+         rss > mark->rss ? (rss - mark->rss) / n : 0.0);
+  if (mark->has_rss_peak)
+  {
+    size_t peak = bench_rss_peak();
+    printf(" %12.2f",
+           peak > mark->rss_peak ? (peak - mark->rss_peak) / n : 0.0);
+  }
+  printf("\n");
+}
+
+static int run_set(uint64_t *keys, size_t n)
+{
+  memory_mark mark;
+  memory_begin(&mark);
+  u64_set set;
+  if (u64_set_init(&set) != HASHSET_OK) return 1;
+  for (size_t i = 0; i < n; ++i)
+    u64_set_insert(&set, keys[i], sizeof(uint64_t));
+  u64_set_resize_wait(&set);
+  memory_report("set", &mark, set.size);
+  u64_set_destroy(&set);
+  return 0;
+}
+
+static int run_u128(uint64_t *keys, size_t n)
+{
+  memory_mark mark;
+  memory_begin(&mark);
+  u128_set set;
+  if (u128_set_init(&set) != HASHSET_OK) return 1;
+  for (size_t i = 0; i < n; ++i)
+    u128_set_insert(&set, (hashset_u128) {
+        .lo = keys[i], .hi = keys[n - 1 - i]});
+  memory_report("u128", &mark, set.size);
+  u128_set_destroy(&set);
+  return 0;
+}
+
+static int run_pointer(uint64_t *keys, size_t n)
+{
+  memory_mark mark;
+  memory_begin(&mark);
+  ptr_set set;
+  if (ptr_set_init(&set) != HASHSET_OK) return 1;
+  for (size_t i = 0; i < n; ++i)
+    ptr_set_insert(&set, (const void *) (uintptr_t) (keys[i] | 8));
+  memory_report("pointer", &mark, set.size);
+  ptr_set_destroy(&set);
+  return 0;
+}
+
+static int run_persistent(uint64_t *keys, size_t n)
+{
+  memory_mark mark;
+  memory_begin(&mark);
+  p64_pset set;
+  if (p64_pset_init(&set) != HASHSET_OK) return 1;
+  for (size_t i = 0; i < n; ++i)
+    p64_pset_insert(&set, keys[i], sizeof(uint64_t));
+  memory_report("persistent", &mark, p64_pset_size(&set));
+  p64_pset_destroy(&set);
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  size_t n = 1000000;
+  uint64_t seed = 42;
+  for (int i = 1; i < argc; ++i)
+  {
+    if (!strcmp(argv[i], "-n") && i + 1 < argc)
+      n = bench_parse_size(argv[++i]);
+    else if (!strcmp(argv[i], "-s") && i + 1 < argc)
+      seed = strtoull(argv[++i], NULL, 10);
+    else
+    {
+      fprintf(stderr, "usage: %s [-n keys] [-s seed]\n", argv[0]);
+      return 1;
+    }
+  }
+
+#ifdef __GLIBC__
+  // A fixed threshold keeps glibc from raising it when tables are
+  // freed, so large tables always go back to the kernel and the
+  // resident set of a layout does not depend on the previous ones
+  mallopt(M_MMAP_THRESHOLD, 128 * 1024);
+#endif
+
+  uint64_t *keys = bench_keys(n, seed);
+  if (!keys) return 1;
+
+  bool has_rss_peak = bench_rss_peak_reset();
+  printf("%-12s %10s %12s %12s %12s", "layout", "entries",
+         "bytes/entry", "peak/entry", "rss/entry");
+  if (has_rss_peak) printf(" %12s", "peak-rss");
+  printf("\n");
+
+  int ret = run_set(keys, n) || run_u128(keys, n)
+    || run_pointer(keys, n) || run_persistent(keys, n);
+
+  free(keys);
+  return ret;
+}
@@ -0,0 +1,175 @@
+// SPDX-License-Identifier: MIT
+//
+// Plays back a trace recorded with HASHSET_TRACE on a set declared
+// with HASHSET_DECLARE, as fast as possible, and reports the time per
+// call. The results are checked against the recorded ones.
+//
+// Each key is hashed to the hash it had when it was recorded, so the
+// table sees the same probes as the recorded program, or with
+// "-x bytes" its bytes are hashed with hashset_hash_bytes. Keys are
+// equal if their bytes are, or with "-e hash" if their hashes and
+// key_len are, for keys that point to their data like strings, whose
+// bytes are only the pointer. Other configurations are measured by
+// rebuilding the tool with BENCH_DEFS, like bench/memory.
+//
+// With -l, every call is timed and the latencies are reported as
+// percentiles per kind of call. With -L, the layout of the table at
+// the end of the trace is written with prefix_set_dump_layout, to see
+// the clusters and the tombstones the workload left.
+//
+// Usage: replay [-r repeat] [-l] [-L] [-e bytes|hash]
+//               [-x recorded|bytes] trace
+//
+// A program records a trace with:
+//
+//    #define HASHSET_TRACE
+//    #include "hashset.h"
+//    ...
+//    hashset_trace trace;
+//    hashset_trace_init(&trace, fopen("set.trace", "wb"));
+//    u32_set_trace(&set, &trace);
+
+#define HASHSET_TRACE
+#include "bench.h"
+
+typedef const bench_call *call_ref;
+
+static size_t key_size;
+static bool eq_by_hash;
+static bool hash_bytes;
+
+static hashset_hash_t replay_hash(call_ref c, unsigned int key_len)
+{
+  (void) key_len;
+  if (hash_bytes)
+    return (hashset_hash_t) hashset_hash_bytes(c->key, key_size);
+  return (hashset_hash_t) c->hash;
+}
+
+static bool replay_eq(call_ref a, unsigned int a_len,
+                      call_ref b, unsigned int b_len)
+{
+  if (eq_by_hash) return a->hash == b->hash && a_len == b_len;
+  return memcmp(a->key, b->key, key_size) == 0;
+}
+
+HASHSET_DECLARE(replay, call_ref, replay_hash, replay_eq)
+
+static const char *op_names[] = {
+  [HASHSET_TRACE_INSERT] = "insert",
+  [HASHSET_TRACE_CONTAINS] = "contains",
+  [HASHSET_TRACE_REMOVE] = "remove",
+};
+
+#define OPS (HASHSET_TRACE_REMOVE + 1)
+
+static bool play(replay_set *set, call_ref c)
+{
+  switch (c->op)
+  {
+  case HASHSET_TRACE_INSERT:
+    return replay_set_insert(set, c, c->key_len);
+  case HASHSET_TRACE_CONTAINS:
+    return replay_set_contains(set, c, c->key_len);
+  default:
+    return replay_set_remove(set, c, c->key_len);
+  }
+}
+
+static int usage(const char *prog)
+{
+  fprintf(stderr, "usage: %s [-r repeat] [-l] [-L] [-e bytes|hash]"
+          " [-x recorded|bytes] trace\n", prog);
+  return 1;
+}
+
+int main(int argc, char **argv)
+{
+  unsigned int repeat = 1;
+  bool latency = false;
+  bool layout = false;
+  const char *path = NULL;
+  for (int i = 1; i < argc; ++i)
+  {
+    if (!strcmp(argv[i], "-r") && i + 1 < argc)
+      repeat = (unsigned int) strtoul(argv[++i], NULL, 10);
+    else if (!strcmp(argv[i], "-l"))
+      latency = true;
+    else if (!strcmp(argv[i], "-L"))
+      layout = true;
+    else if (!strcmp(argv[i], "-e") && i + 1 < argc)
+    {
+      const char *mode = argv[++i];
+      if (!strcmp(mode, "hash")) eq_by_hash = true;
+      else if (strcmp(mode, "bytes")) return usage(argv[0]);
+    }
+    else if (!strcmp(argv[i], "-x") && i + 1 < argc)
+    {
+      const char *mode = argv[++i];
+      if (!strcmp(mode, "bytes")) hash_bytes = true;
+      else if (strcmp(mode, "recorded")) return usage(argv[0]);
+    }
+    else if (argv[i][0] != '-' && !path)
+      path = argv[i];
+    else
+      return usage(argv[0]);
+  }
+  if (!path) return usage(argv[0]);
+
+  bench_trace trace;
+  if (bench_trace_load(path, &trace)) return 1;
+  key_size = trace.key_size;
+
+  bench_hist *hists = latency ? calloc(OPS, sizeof(bench_hist)) : NULL;
+  if (latency && !hists) return 1;
+
+  printf("%-8s %12s %12s %10s %10s %10s\n", "run", "calls", "ns/call",
+         "mismatch", "size", "capacity");
+  for (unsigned int r = 0; r < repeat; ++r)
+  {
+    replay_set set;
+    if (replay_set_init(&set) != HASHSET_OK) return 1;
+
+    size_t mismatches = 0;
+    uint64_t start = bench_now_ns();
+    for (size_t i = 0; i < trace.len; ++i)
+    {
+      call_ref c = bench_trace_call(&trace, i);
+      bool ret;
+      if (latency)
+      {
+        uint64_t t = bench_now_ns();
+        ret = play(&set, c);
+        bench_hist_add(&hists[c->op], bench_now_ns() - t);
+      }
+      else
+        ret = play(&set, c);
+      mismatches += ret != c->result;
+    }
+    replay_set_resize_wait(&set);
+    uint64_t ns = bench_now_ns() - start;
+
+    printf("%-8u %12zu %12.2f %10zu %10zu %10zu\n", r, trace.len,
+           trace.len ? (double) ns / trace.len : 0.0, mismatches,
+           set.size, set.capacity);
+    if (layout && r + 1 == repeat)
+    {
+      printf("\n");
+      replay_set_dump_layout(&set, stdout);
+      printf("\n");
+    }
+    replay_set_destroy(&set);
+  }
+
+  if (latency)
+  {
+    printf("\n");
+    bench_hist_report_header();
+    for (int op = HASHSET_TRACE_INSERT; op < OPS; ++op)
+      bench_hist_report(op_names[op], &hists[op]);
+    free(hists);
+  }
+
+  free(trace.calls);
+  return 0;
+}
@@ -0,0 +1,415 @@
+// SPDX-License-Identifier: MIT
+//
+// Measures how the thread safe ways of using a set scale with the
+// number of threads:
+//
+//    mutex      a prefix_set behind one pthread mutex
+//    sharded    prefix_sets behind a mutex each, picked by the key
+//    fc         HASHSET_DECLARE_FLAT_COMBINING
+//    grow-only  HASHSET_DECLARE_GROW_ONLY, writes are only inserts
+//
+// Each thread is pinned to its own CPU and runs a mix of lookups and
+// writes for a while on a set prefilled with half of n keys. Writes
+// insert or remove, half each, so the size stays the same. The keys
+// are picked uniformly or with a zipf distribution where a few keys
+// are much hotter than the others.
+//
+// For each run it reports the operations per second of all threads
+// together and how fairly the threads shared them, with the Jain
+// index (1 when every thread did the same, 1/threads when one did
+// everything) and the ratio between the slowest and fastest thread.
+//
+// Usage: scale [-n keys] [-t max_threads] [-r read%] [-z theta]
+//              [-d ms] [-S shards] [-v variant] [-s seed]
+//
+// Without -r the read ratios are 100, 90 and 50%, without -t the
+// thread counts double up to the number of CPUs.
+
+#define HASHSET_THREADS
+#include "bench.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+
+HASHSET_DECLARE(u64, uint64_t, bench_hash_u64, bench_eq_u64)
+HASHSET_DECLARE_FLAT_COMBINING(u64, uint64_t)
+HASHSET_DECLARE_GROW_ONLY(u64, uint64_t, bench_hash_u64, bench_eq_u64)
+
+enum {
+  VARIANT_MUTEX,
+  VARIANT_SHARDED,
+  VARIANT_FC,
+  VARIANT_GROW_ONLY,
+  VARIANTS,
+};
+
+static const char *variant_names[VARIANTS] = {
+  "mutex", "sharded", "fc", "grow-only",
+};
+
+// Operations between two looks at the stop flag
+#define SCALE_BATCH 256
+// Keys picked in advance by each thread
+#define SCALE_PICKS (1 << 16)
+
+typedef struct {
+  pthread_mutex_t lock;
+  u64_set set;
+  char pad[64];
+} shard;
+
+typedef struct {
+  int variant;
+  pthread_mutex_t lock;
+  u64_set set;
+  shard *shards;
+  unsigned int shard_bits;
+  u64_fc_set *fc;
+  u64_gset gset;
+} target;
+
+typedef struct {
+  pthread_t thread;
+  target *t;
+  unsigned int id;
+  int cpu;
+  unsigned int read_pct;
+  const uint64_t *keys;
+  const uint32_t *picks; // indexes in keys
+  int *go;
+  int *stop;
+  uint64_t ops;
+  char pad[64];
+} worker;
+
+static int target_init(target *t, int variant, unsigned int shards)
+{
+  *t = (target) {.variant = variant};
+  switch (variant)
+  {
+  case VARIANT_MUTEX:
+    if (pthread_mutex_init(&t->lock, NULL) != 0)
+      return HASHSET_ERROR_ALLOCATION;
+    return u64_set_init(&t->set);
+  case VARIANT_SHARDED:
+    while ((1u << t->shard_bits) < shards) t->shard_bits++;
+    t->shards = calloc((size_t) 1 << t->shard_bits, sizeof(shard));
+    if (!t->shards) return HASHSET_ERROR_ALLOCATION;
+    for (size_t s = 0; s < (size_t) 1 << t->shard_bits; ++s)
+    {
+      if (pthread_mutex_init(&t->shards[s].lock, NULL) != 0)
+        return HASHSET_ERROR_ALLOCATION;
+      int err = u64_set_init(&t->shards[s].set);
+      if (err != HASHSET_OK) return err;
+    }
+    return HASHSET_OK;
+  case VARIANT_FC:
+    if (posix_memalign((void **) &t->fc, 64, sizeof(u64_fc_set)) != 0)
+      return HASHSET_ERROR_ALLOCATION;
+    return u64_fc_set_init(t->fc);
+  default:
+    return u64_gset_init(&t->gset);
+  }
+}
+
+static void target_destroy(target *t)
+{
+  switch (t->variant)
+  {
+  case VARIANT_MUTEX:
+    u64_set_destroy(&t->set);
+    pthread_mutex_destroy(&t->lock);
+    break;
+  case VARIANT_SHARDED:
+    for (size_t s = 0; s < (size_t) 1 << t->shard_bits; ++s)
+    {
+      u64_set_destroy(&t->shards[s].set);
+      pthread_mutex_destroy(&t->shards[s].lock);
+    }
+    free(t->shards);
+    break;
+  case VARIANT_FC:
+    u64_fc_set_destroy(t->fc);
+    free(t->fc);
+    break;
+  default:
+    u64_gset_destroy(&t->gset);
+  }
+}
+
+static bool set_op(u64_set *set, int write, uint64_t key)
+{
+  if (!write) return u64_set_contains(set, key, sizeof(uint64_t));
+  if (write == 1) return u64_set_insert(set, key, sizeof(uint64_t));
+  return u64_set_remove(set, key, sizeof(uint64_t));
+}
+
+// [write] is 0 for a lookup, 1 for an insert and 2 for a remove
+static bool target_op(target *t, int slot, int write, uint64_t key)
+{
+  bool ret;
+  switch (t->variant)
+  {
+  case VARIANT_MUTEX:
+    pthread_mutex_lock(&t->lock);
+    ret = set_op(&t->set, write, key);
+    pthread_mutex_unlock(&t->lock);
+    return ret;
+  case VARIANT_SHARDED:
+  {
+    // The set hashes the low bits, the shard takes the high ones
+    shard *s = &t->shards[t->shard_bits
+      ? (key * 0x9e3779b97f4a7c15ULL) >> (64 - t->shard_bits) : 0];
+    pthread_mutex_lock(&s->lock);
+    ret = set_op(&s->set, write, key);
+    pthread_mutex_unlock(&s->lock);
+    return ret;
+  }
+  case VARIANT_FC:
+    if (!write)
+      return u64_fc_set_contains(t->fc, slot, key, sizeof(uint64_t));
+    if (write == 1)
+      return u64_fc_set_insert(t->fc, slot, key, sizeof(uint64_t));
+    return u64_fc_set_remove(t->fc, slot, key, sizeof(uint64_t));
+  default:
+    if (!write) return u64_gset_contains(&t->gset, key, sizeof(uint64_t));
+    return u64_gset_insert(&t->gset, key, sizeof(uint64_t));
+  }
+}
+
+static void *worker_run(void *arg)
+{
+  worker *w = arg;
+  target *t = w->t;
+
+#ifdef __linux__
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(w->cpu, &cpus);
+  pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+#endif
+
+  int slot = t->variant == VARIANT_FC ? u64_fc_set_register(t->fc) : 0;
+  if (slot < 0) return NULL;
+
+  while (!__atomic_load_n(w->go, __ATOMIC_ACQUIRE))
+    ;
+
+  uint64_t ops = 0, seed = (uint64_t) w->id + 1;
+  size_t pick = (size_t) hashset_rand(&seed) % SCALE_PICKS;
+  int next_write = 1;
+  while (!__atomic_load_n(w->stop, __ATOMIC_RELAXED))
+  {
+    for (int i = 0; i < SCALE_BATCH; ++i)
+    {
+      uint64_t key = w->keys[w->picks[pick]];
+      pick = (pick + 1) % SCALE_PICKS;
+      if (hashset_rand(&seed) % 100 < w->read_pct)
+        target_op(t, slot, 0, key);
+      else
+      {
+        target_op(t, slot, next_write, key);
+        next_write = 3 - next_write;
+      }
+    }
+    ops += SCALE_BATCH;
+  }
+  w->ops = ops;
+  return NULL;
+}
+
+// Cumulative zipf probabilities of the first [n] keys
+static double *make_zipf(size_t n, double theta)
+{
+  double *cdf = malloc(n * sizeof(double));
+  if (!cdf) return NULL;
+  double sum = 0;
+  for (size_t i = 0; i < n; ++i)
+    cdf[i] = sum += 1 / pow((double) (i + 1), theta);
+  for (size_t i = 0; i < n; ++i)
+    cdf[i] /= sum;
+  return cdf;
+}
+
+// Key indexes below [n], uniform without [cdf]
+static uint32_t *make_picks(size_t n, const double *cdf, uint64_t seed)
+{
+  uint32_t *picks = malloc(SCALE_PICKS * sizeof(uint32_t));
+  if (!picks) return NULL;
+  for (size_t i = 0; i < SCALE_PICKS; ++i)
+  {
+    uint64_t r = hashset_rand(&seed);
+    if (!cdf)
+    {
+      picks[i] = (uint32_t) (r % n);
+      continue;
+    }
+    double u = (double) (r >> 11) / (double) (1ULL << 53);
+    size_t lo = 0, hi = n - 1;
+    while (lo < hi)
+    {
+      size_t mid = lo + (hi - lo) / 2;
+      if (cdf[mid] < u) lo = mid + 1;
+      else hi = mid;
+    }
+    picks[i] = (uint32_t) lo;
+  }
+  return picks;
+}
+
+static int run(int variant, unsigned int nthreads, unsigned int read_pct,
+               const char *dist, const uint64_t *keys, size_t n,
+               uint32_t **picks, unsigned int shards, unsigned int ms)
+{
+  target t;
+  if (target_init(&t, variant, shards) != HASHSET_OK) return 1;
+  // Prefill from one slot, the workers register the others
+  int slot = variant == VARIANT_FC ? u64_fc_set_register(t.fc) : 0;
+  for (size_t i = 0; i < n / 2; ++i)
+    target_op(&t, slot, 1, keys[i]);
+
+  worker *workers = calloc(nthreads, sizeof(worker));
+  if (!workers) return 1;
+  int go = 0, stop = 0;
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  for (unsigned int i = 0; i < nthreads; ++i)
+  {
+    workers[i] = (worker) {
+      .t = &t, .id = i, .cpu = (int) (i % (cpus > 0 ? cpus : 1)),
+      .read_pct = read_pct, .keys = keys, .picks = picks[i],
+      .go = &go, .stop = &stop,
+    };
+    if (pthread_create(&workers[i].thread, NULL, worker_run,
+                       &workers[i]) != 0)
+      return 1;
+  }
+
+  uint64_t start = bench_now_ns();
+  __atomic_store_n(&go, 1, __ATOMIC_RELEASE);
+  struct timespec wait = {ms / 1000, (long) (ms % 1000) * 1000000};
+  nanosleep(&wait, NULL);
+  __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+  for (unsigned int i = 0; i < nthreads; ++i)
+    pthread_join(workers[i].thread, NULL);
+  double secs = (bench_now_ns() - start) / 1e9;
+
+  double total = 0, squares = 0;
+  uint64_t min = UINT64_MAX, max = 0;
+  for (unsigned int i = 0; i < nthreads; ++i)
+  {
+    double ops = (double) workers[i].ops;
+    total += ops;
+    squares += ops * ops;
+    if (workers[i].ops < min) min = workers[i].ops;
+    if (workers[i].ops > max) max = workers[i].ops;
+  }
+  printf("%-10s %-8s %5u%% %8u %12.2f %8.3f %8.3f\n",
+         variant_names[variant], dist, read_pct, nthreads,
+         total / secs / 1e6,
+         squares ? total * total / (nthreads * squares) : 0.0,
+         max ? (double) min / max : 0.0);
+  fflush(stdout);
+
+  free(workers);
+  target_destroy(&t);
+  return 0;
+}
+
+static int usage(const char *prog)
+{
+  fprintf(stderr, "usage: %s [-n keys] [-t max_threads] [-r read%%]"
+          " [-z theta] [-d ms] [-S shards] [-v variant] [-s seed]\n",
+          prog);
+  return 1;
+}
+
+int main(int argc, char **argv)
+{
+  size_t n = 1000000;
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  unsigned int max_threads = cpus > 0 ? (unsigned int) cpus : 1;
+  int read_pct = -1;
+  double theta = 0.99;
+  unsigned int ms = 100;
+  unsigned int shards = 16;
+  int only = -1;
+  uint64_t seed = 42;
+  for (int i = 1; i < argc; ++i)
+  {
+    if (!strcmp(argv[i], "-n") && i + 1 < argc)
+      n = bench_parse_size(argv[++i]);
+    else if (!strcmp(argv[i], "-t") && i + 1 < argc)
+      max_threads = (unsigned int) strtoul(argv[++i], NULL, 10);
+    else if (!strcmp(argv[i], "-r") && i + 1 < argc)
+      read_pct = (int) strtol(argv[++i], NULL, 10);
+    else if (!strcmp(argv[i], "-z") && i + 1 < argc)
+      theta = strtod(argv[++i], NULL);
+    else if (!strcmp(argv[i], "-d") && i + 1 < argc)
+      ms = (unsigned int) strtoul(argv[++i], NULL, 10);
+    else if (!strcmp(argv[i], "-S") && i + 1 < argc)
+      shards = (unsigned int) strtoul(argv[++i], NULL, 10);
+    else if (!strcmp(argv[i], "-v") && i + 1 < argc)
+    {
+      const char *name = argv[++i];
+      for (int v = 0; v < VARIANTS; ++v)
+        if (!strcmp(name, variant_names[v])) only = v;
+      if (only < 0) return usage(argv[0]);
+    }
+    else if (!strcmp(argv[i], "-s") && i + 1 < argc)
+      seed = strtoull(argv[++i], NULL, 10);
+    else
+      return usage(argv[0]);
+  }
+  if (n < 2) n = 2;
+  if (max_threads < 1) max_threads = 1;
+  if (max_threads > HASHSET_FC_SLOTS - 1)
+    max_threads = HASHSET_FC_SLOTS - 1;
+  if (read_pct > 100) read_pct = 100;
+
+  uint64_t *keys = bench_keys(n, seed);
+  double *cdf = make_zipf(n, theta);
+  uint32_t **uniform = calloc(max_threads, sizeof(uint32_t *));
+  uint32_t **zipf = calloc(max_threads, sizeof(uint32_t *));
+  if (!keys || !cdf || !uniform || !zipf) return 1;
+  for (unsigned int i = 0; i < max_threads; ++i)
+  {
+    uniform[i] = make_picks(n, NULL, seed + 2 * i + 1);
+    zipf[i] = make_picks(n, cdf, seed + 2 * i + 2);
+    if (!uniform[i] || !zipf[i]) return 1;
+  }
+  free(cdf);
+
+  static const unsigned int read_pcts[] = {100, 90, 50};
+  printf("%-10s %-8s %6s %8s %12s %8s %8s\n", "variant", "keys",
+         "reads", "threads", "Mops/s", "jain", "min/max");
+  for (int v = 0; v < VARIANTS; ++v)
+  {
+    if (only >= 0 && v != only) continue;
+    for (int d = 0; d < 2; ++d)
+      for (size_t r = 0; r < 3; ++r)
+      {
+        if (read_pct >= 0 && r > 0) break;
+        unsigned int pct = read_pct >= 0
+          ? (unsigned int) read_pct : read_pcts[r];
+        for (unsigned int threads = 1;; threads *= 2)
+        {
+          if (threads > max_threads) threads = max_threads;
+          if (run(v, threads, pct, d ? "zipf" : "uniform", keys, n,
+                  d ? zipf : uniform, shards, ms))
+            return 1;
+          if (threads == max_threads) break;
+        }
+      }
+  }
+
+  for (unsigned int i = 0; i < max_threads; ++i)
+  {
+    free(uniform[i]);
+    free(zipf[i]);
+  }
+  free(uniform);
+  free(zipf);
+  free(keys);
+  return 0;
+}
@@ -0,0 +1,447 @@
+// SPDX-License-Identifier: MIT
+//
+// Runs a workload on every configuration of a sweep and recommends
+// one, as a header snippet:
+//
+//    load factor        HASHSET_MAX_LOAD_FACTOR from 0.5 to 0.9
+//    growth factor      HASHSET_GROWTH_FACTOR 2 and 4
+//    initial capacity   HASHSET_INITIAL_CAPACITY 16, 1024, and the
+//                       capacity that holds the most keys the workload
+//                       keeps at once without growing
+//    layout             "set" probes linearly one slot at a time, like
+//                       HASHSET_DECLARE, "group" probes 16 slots at a
+//                       time with SSE2, like HASHSET_DECLARE_U128
+//
+// Each configuration reports the time per call, the best of -r runs,
+// and the peak bytes allocated per entry, with old and new tables both
+// alive during a resize. The configurations that no other one beats
+// on both are the Pareto frontier, marked with a '*'. The recommended
+// one is the frontier configuration with the lowest product of the
+// two, or with -m the fastest one that peaks below a number of bytes
+// per entry.
+//
+// The workload is synthetic: n random keys are inserted, then 4n calls
+// pick a key among 2n, -c percent of them contains and the others
+// inserts and removes in equal parts. Or it is a trace recorded with
+// HASHSET_TRACE: keys of up to 8 bytes are taken as they are, longer
+// ones are hashed to 64 bits, and with "-e hash" keys are their
+// recorded hash and key_len, as in bench/replay. Every key is then
+// hashed with bench_hash_u64, so the sweep measures the table and not
+// the hash and eq functions of the recorded program.
+//
+// Usage: tune [-n keys] [-c percent] [-s seed] [-r repeat]
+//             [-m bytes] [-e bytes|hash] [trace]
+//
+// The sweep reads the configuration from variables instead of
+// constants, which costs a little time on every call: the times are
+// to compare the configurations between them, bench/bench measures a
+// build with the recommended constants.
+
+// The sweep sets them, whatever BENCH_DEFS says
+#undef HASHSET_MAX_LOAD_FACTOR
+#undef HASHSET_GROWTH_FACTOR
+#undef HASHSET_INITIAL_CAPACITY
+#define HASHSET_MAX_LOAD_FACTOR tune_max_load
+#define HASHSET_GROWTH_FACTOR tune_growth
+#define HASHSET_INITIAL_CAPACITY tune_initial_capacity
+#define BENCH_COUNT_ALLOCS
+#include "bench.h"
+
+static double tune_max_load = 0.7;
+static size_t tune_growth = 2;
+static size_t tune_initial_capacity = 16;
+
+HASHSET_DECLARE(u64, uint64_t, bench_hash_u64, bench_eq_u64)
+HASHSET_DECLARE_U128(u128)
+
+static const double loads[] = {0.5, 0.6, 0.7, 0.8, 0.9};
+static const size_t growths[] = {2, 4};
+static const size_t initial_capacities[] = {16, 1024, 0}; // 0 is fit
+
+#define COUNT(array) (sizeof(array) / sizeof((array)[0]))
+
+enum {
+  LAYOUT_SET,
+  LAYOUT_GROUP,
+  LAYOUTS,
+};
+
+static const char *layout_names[LAYOUTS] = {"set", "group"};
+
+//
+// Workloads
+//
+
+typedef struct {
+  uint8_t *ops;
+  uint64_t *keys;
+  uint8_t *results;
+  size_t len;
+  size_t max_size; // most keys in the set at once
+} workload;
+
+static bool workload_alloc(workload *w, size_t len)
+{
+  w->len = len;
+  w->ops = malloc(len);
+  w->keys = malloc(len * sizeof(uint64_t));
+  w->results = malloc(len);
+  return w->ops && w->keys && w->results;
+}
+
+static void workload_free(workload *w)
+{
+  free(w->ops);
+  free(w->keys);
+  free(w->results);
+}
+
+static int workload_synthetic(workload *w, size_t n, unsigned int contains,
+                              uint64_t seed)
+{
+  uint64_t *pool = bench_keys(2 * n, seed);
+  if (!pool || !workload_alloc(w, 5 * n))
+  {
+    free(pool);
+    return 1;
+  }
+
+  for (size_t i = 0; i < n; ++i)
+  {
+    w->ops[i] = HASHSET_TRACE_INSERT;
+    w->keys[i] = pool[i];
+  }
+  for (size_t i = n; i < w->len; ++i)
+  {
+    uint64_t r = hashset_rand(&seed);
+    unsigned int pick = (unsigned int) (r % 200);
+    w->ops[i] = pick < 2 * contains ? HASHSET_TRACE_CONTAINS
+      : pick % 2 ? HASHSET_TRACE_INSERT : HASHSET_TRACE_REMOVE;
+    w->keys[i] = pool[(r >> 8) % (2 * n)];
+  }
+  free(pool);
+  return 0;
+}
+
+static int workload_trace(workload *w, const char *path, bool eq_by_hash)
+{
+  bench_trace trace;
+  if (bench_trace_load(path, &trace)) return 1;
+  if (!workload_alloc(w, trace.len))
+  {
+    free(trace.calls);
+    return 1;
+  }
+
+  for (size_t i = 0; i < trace.len; ++i)
+  {
+    const bench_call *c = bench_trace_call(&trace, i);
+    uint64_t key = 0;
+    if (eq_by_hash)
+    {
+      uint64_t id[2] = {c->hash, c->key_len};
+      key = hashset_hash_bytes(id, sizeof(id));
+    }
+    else if (trace.key_size <= sizeof(key))
+      memcpy(&key, c->key, trace.key_size);
+    else
+      key = hashset_hash_bytes(c->key, trace.key_size);
+    w->ops[i] = c->op;
+    w->keys[i] = key;
+  }
+  free(trace.calls);
+  return 0;
+}
+
+// Plays [w] once to know its results and the most keys it holds
+static int workload_prepare(workload *w)
+{
+  u64_set set;
+  if (u64_set_init(&set) != HASHSET_OK) return 1;
+  w->max_size = 0;
+  for (size_t i = 0; i < w->len; ++i)
+  {
+    uint64_t key = w->keys[i];
+    switch (w->ops[i])
+    {
+    case HASHSET_TRACE_INSERT:
+      w->results[i] = u64_set_insert(&set, key, sizeof(key));
+      break;
+    case HASHSET_TRACE_CONTAINS:
+      w->results[i] = u64_set_contains(&set, key, sizeof(key));
+      break;
+    default:
+      w->results[i] = u64_set_remove(&set, key, sizeof(key));
+    }
+    if (set.size > w->max_size) w->max_size = set.size;
+  }
+  u64_set_destroy(&set);
+  return 0;
+}
+
+//
+// Sweep
+//
+
+typedef struct {
+  double load;
+  size_t growth;
+  size_t initial_capacity;
+  int layout;
+  double ns; // per call
+  double bytes; // peak per entry
+  bool frontier;
+} config;
+
+// Calls of [w] that returned something else than when it was prepared
+static size_t run_set(workload *w)
+{
+  size_t mismatches = 0;
+  u64_set set;
+  if (u64_set_init(&set) != HASHSET_OK) return w->len;
+  for (size_t i = 0; i < w->len; ++i)
+  {
+    uint64_t key = w->keys[i];
+    bool ret;
+    switch (w->ops[i])
+    {
+    case HASHSET_TRACE_INSERT:
+      ret = u64_set_insert(&set, key, sizeof(key));
+      break;
+    case HASHSET_TRACE_CONTAINS:
+      ret = u64_set_contains(&set, key, sizeof(key));
+      break;
+    default:
+      ret = u64_set_remove(&set, key, sizeof(key));
+    }
+    mismatches += ret != w->results[i];
+  }
+  u64_set_destroy(&set);
+  return mismatches;
+}
+
+static size_t run_group(workload *w)
+{
+  size_t mismatches = 0;
+  u128_set set;
+  if (u128_set_init(&set) != HASHSET_OK) return w->len;
+  for (size_t i = 0; i < w->len; ++i)
+  {
+    hashset_u128 key = {.lo = w->keys[i]};
+    bool ret;
+    switch (w->ops[i])
+    {
+    case HASHSET_TRACE_INSERT:
+      ret = u128_set_insert(&set, key);
+      break;
+    case HASHSET_TRACE_CONTAINS:
+      ret = u128_set_contains(&set, key);
+      break;
+    default:
+      ret = u128_set_remove(&set, key);
+    }
+    mismatches += ret != w->results[i];
+  }
+  u128_set_destroy(&set);
+  return mismatches;
+}
+
+static void run_config(workload *w, config *c, unsigned int repeat)
+{
+  tune_max_load = c->load;
+  tune_growth = c->growth;
+  tune_initial_capacity = c->initial_capacity;
+
+  c->ns = 0;
+  bench_alloc_peak = bench_alloc_live;
+  size_t base = bench_alloc_live;
+  for (unsigned int r = 0; r < repeat; ++r)
+  {
+    uint64_t start = bench_now_ns();
+    size_t mismatches = c->layout == LAYOUT_SET ? run_set(w) : run_group(w);
+    double ns = w->len ? (double) (bench_now_ns() - start) / w->len : 0;
+    if (!r || ns < c->ns) c->ns = ns;
+    if (mismatches)
+      fprintf(stderr, "%s: %zu mismatches\n", layout_names[c->layout],
+              mismatches);
+  }
+  c->bytes = (double) (bench_alloc_peak - base)
+    / (w->max_size ? w->max_size : 1);
+}
+
+// The smallest capacity that holds [n] keys at [load]
+static size_t fit_capacity(size_t n, double load)
+{
+  size_t capacity = HASHSET_GROUP;
+  while ((double) n / capacity > load) capacity *= 2;
+  return capacity;
+}
+
+static size_t sweep(workload *w, config *configs, unsigned int repeat)
+{
+  size_t count = 0;
+  for (size_t l = 0; l < COUNT(loads); ++l)
+  {
+    size_t fit = fit_capacity(w->max_size, loads[l]);
+    for (size_t g = 0; g < COUNT(growths); ++g)
+      for (size_t i = 0; i < COUNT(initial_capacities); ++i)
+      {
+        size_t initial = initial_capacities[i];
+        if (!initial)
+        {
+          // Fit is one of the fixed capacities already
+          bool seen = false;
+          for (size_t j = 0; j < i; ++j)
+            seen |= initial_capacities[j] == fit;
+          if (seen) continue;
+          initial = fit;
+        }
+        for (int layout = 0; layout < LAYOUTS; ++layout)
+        {
+          config *c = &configs[count++];
+          *c = (config) {
+            .load = loads[l],
+            .growth = growths[g],
+            .initial_capacity = initial,
+            .layout = layout,
+          };
+          run_config(w, c, repeat);
+        }
+      }
+  }
+  return count;
+}
+
+static void mark_frontier(config *configs, size_t count)
+{
+  for (size_t i = 0; i < count; ++i)
+  {
+    config *c = &configs[i];
+    c->frontier = true;
+    for (size_t j = 0; j < count && c->frontier; ++j)
+    {
+      config *o = &configs[j];
+      if (o->ns <= c->ns && o->bytes <= c->bytes
+          && (o->ns < c->ns || o->bytes < c->bytes))
+        c->frontier = false;
+    }
+  }
+}
+
+// The best config of the frontier, or the fastest under [max_bytes]
+static config *recommend(config *configs, size_t count, double max_bytes)
+{
+  config *best = NULL;
+  for (size_t i = 0; i < count; ++i)
+  {
+    config *c = &configs[i];
+    if (max_bytes > 0)
+    {
+      if (c->bytes <= max_bytes && (!best || c->ns < best->ns))
+        best = c;
+    }
+    else if (c->frontier
+             && (!best || c->ns * c->bytes < best->ns * best->bytes))
+      best = c;
+  }
+  return best;
+}
+
+static void print_snippet(config *c, const char *workload_name)
+{
+  printf("// Recommended by bench/tune for %s:\n"
+         "// %.2f ns/call, %.2f peak bytes/entry\n"
+         "#define HASHSET_MAX_LOAD_FACTOR %.1f\n"
+         "#define HASHSET_GROWTH_FACTOR %zu\n"
+         "#define HASHSET_INITIAL_CAPACITY %zu\n",
+         workload_name, c->ns, c->bytes, c->load, c->growth,
+         c->initial_capacity);
+  if (c->layout == LAYOUT_GROUP)
+    printf("// Layout: HASHSET_DECLARE_U128, if the keys fit 128 bits\n");
+  else
+    printf("// Layout: HASHSET_DECLARE\n");
+}
+
+static int usage(const char *prog)
+{
+  fprintf(stderr, "usage: %s [-n keys] [-c percent] [-s seed]"
+          " [-r repeat] [-m bytes] [-e bytes|hash] [trace]\n", prog);
+  return 1;
+}
+
+int main(int argc, char **argv)
+{
+  size_t n = 200000;
+  unsigned int contains = 80;
+  uint64_t seed = 42;
+  unsigned int repeat = 3;
+  double max_bytes = 0;
+  bool eq_by_hash = false;
+  const char *path = NULL;
+  for (int i = 1; i < argc; ++i)
+  {
+    if (!strcmp(argv[i], "-n") && i + 1 < argc)
+      n = bench_parse_size(argv[++i]);
+    else if (!strcmp(argv[i], "-c") && i + 1 < argc)
+      contains = (unsigned int) strtoul(argv[++i], NULL, 10);
+    else if (!strcmp(argv[i], "-s") && i + 1 < argc)
+      seed = strtoull(argv[++i], NULL, 10);
+    else if (!strcmp(argv[i], "-r") && i + 1 < argc)
+      repeat = (unsigned int) strtoul(argv[++i], NULL, 10);
+    else if (!strcmp(argv[i], "-m") && i + 1 < argc)
+      max_bytes = strtod(argv[++i], NULL);
+    else if (!strcmp(argv[i], "-e") && i + 1 < argc)
+    {
+      const char *mode = argv[++i];
+      if (!strcmp(mode, "hash")) eq_by_hash = true;
+      else if (strcmp(mode, "bytes")) return usage(argv[0]);
+    }
+    else if (argv[i][0] != '-' && !path)
+      path = argv[i];
+    else
+      return usage(argv[0]);
+  }
+  if (contains > 100 || !repeat || !n) return usage(argv[0]);
+
+  workload w = {0};
+  int err = path ? workload_trace(&w, path, eq_by_hash)
+    : workload_synthetic(&w, n, contains, seed);
+  if (err || workload_prepare(&w))
+  {
+    workload_free(&w);
+    return 1;
+  }
+
+  char workload_name[256];
+  if (path)
+    snprintf(workload_name, sizeof(workload_name), "%s", path);
+  else
+    snprintf(workload_name, sizeof(workload_name),
+             "%zu keys, %u%% contains", n, contains);
+
+  config configs[COUNT(loads) * COUNT(growths)
+                 * COUNT(initial_capacities) * LAYOUTS];
+  size_t count = sweep(&w, configs, repeat);
+  mark_frontier(configs, count);
+
+  printf("%zu calls, at most %zu keys\n\n", w.len, w.max_size);
+  printf("  %-6s %6s %8s %10s %10s %12s\n", "layout", "load", "growth",
+         "initial", "ns/call", "bytes/entry");
+  for (size_t i = 0; i < count; ++i)
+  {
+    config *c = &configs[i];
+    printf("%c %-6s %6.1f %8zu %10zu %10.2f %12.2f\n",
+           c->frontier ? '*' : ' ', layout_names[c->layout], c->load,
+           c->growth, c->initial_capacity, c->ns, c->bytes);
+  }
+  printf("\n");
+
+  config *best = recommend(configs, count, max_bytes);
+  if (best)
+    print_snippet(best, workload_name);
+  else
+    printf("no configuration peaks below %.2f bytes/entry\n", max_bytes);
+
+  workload_free(&w);
+  return 0;
+}
@@ -4,6 +4,7 @@
 #include "hashset.h"
 
 #include <stdio.h>
+#include <string.h>
 #include <assert.h>
 
 bool eq_u32(uint32_t a, unsigned int a_size,
@@ -13,6 +14,27 @@ bool eq_u32(uint32_t a, unsigned int a_size,
 // Declare a uint32_t hashset
 HASHSET_DECLARE(u32, uint32_t, hashset_hash_int32, eq_u32)
 
+// Larger keys are better passed by pointer
+typedef struct {
+    char name[32];
+} label;
+
+hashset_hash_t hash_label(const label *l, unsigned int len)
+{ return (hashset_hash_t) hashset_hash_bytes(l->name, len); }
+
+bool eq_label(const label *a, unsigned int a_len,
+              const label *b, unsigned int b_len)
+{ return a_len == b_len && memcmp(a->name, b->name, a_len) == 0; }
+
+HASHSET_DECLARE_REF(label, label, hash_label, eq_label)
+
+// Structs without padding can be hashed and compared as bytes
+typedef struct {
+    int32_t x, y;
+} point;
+
+HASHSET_DECLARE_POD(point, point)
+
 int main(void) {
     u32_set s;
     assert(u32_set_init(&s) == 0);
@@ -27,5 +49,21 @@ int main(void) {
     assert(u32_set_contains(&s, 42, 0) == 0);
 
     u32_set_destroy(&s);
+
+    label_set labels;
+    assert(label_set_init(&labels) == 0);
+    label l = { "hello" };
+    assert(label_set_insert(&labels, &l, strlen(l.name)) == 1);
+    assert(label_set_contains(&labels, &l, strlen(l.name)) == 1);
+    label_set_destroy(&labels);
+
+    point_set points;
+    assert(point_set_init(&points) == 0);
+    point p = { 3, 4 };
+    assert(point_set_insert(&points, &p, 0) == 1);
+    assert(point_set_contains(&points, &p, 0) == 1);
+    assert(point_set_remove(&points, &p, 0) == 1);
+    point_set_destroy(&points);
+
     return 0;
 }
@@ -33,6 +33,75 @@
 //                bool eq_fn(type a, unsigned int a_len,
 //                           type b, unsigned int b_len);
 //
+//    HASHSET_DECLARE_REF(prefix, type, hash_fn, eq_fn)
+//        Like HASHSET_DECLARE, but keys are passed by pointer to avoid
+//        copying large keys on every call. The functions take
+//        [const type *key] instead of [type key], and hash_fn and
+//        eq_fn must have the signatures:
+//
+//                hashset_hash_t hash_fn(const type *val,
+//                                       unsigned int val_len);
+//                bool eq_fn(const type *a, unsigned int a_len,
+//                           const type *b, unsigned int b_len);
+//
+//        Keys are still stored by value in the set. Functions taking
+//        arrays of keys or returning keys are the same for both.
+//
+//    HASHSET_DECLARE_POD(prefix, type)
+//        Like HASHSET_DECLARE_REF, for plain structs compared byte by
+//        byte. The hash reads the key 8 bytes at a time and equality
+//        is a memcmp of sizeof(type) bytes, both specialized by the
+//        compiler for the size of [type]. The key_len arguments are
+//        ignored.
+//        Notes: Types with padding are not supported. Padding bytes
+//        would be hashed and compared too, and struct assignment,
+//        which the set uses to store and move keys, does not keep
+//        them. Add explicit fields for the padding, and set them.
+//
+//    HASHSET_DECLARE_U128(prefix)
+//        Declare prefix_set for 128 bit keys like UUIDs, of type
+//        hashset_u128 {uint64_t lo, hi}. Slots are 16 bytes, with
+//        no size, and a separate control byte keeps 7 bits of the
+//        hash of each key. Lookups check the control bytes of 16
+//        slots at a time and compare only the keys whose fingerprint
+//        matches, with SSE2 when available. The hash is a cheap
+//        mixer that expects keys that are random already. The
+//        functions are prefix_set_init, prefix_set_destroy and
+//        prefix_set_resize as above, and:
+//
+//                bool prefix_set_insert(prefix_set *set,
+//                                       hashset_u128 key);
+//                bool prefix_set_contains(prefix_set *set,
+//                                         hashset_u128 key);
+//                bool prefix_set_remove(prefix_set *set,
+//                                       hashset_u128 key);
+//
+//    HASHSET_DECLARE_POINTER(prefix)
+//        Declare prefix_set for pointers compared by address, like
+//        the visited set of a graph walk. Only the pointers are
+//        stored, NULL marks an empty slot, and removals shift the
+//        following keys back so there are no tombstones. The hash
+//        drops the 3 low bits of the address, which are zero for
+//        aligned objects, and mixes the rest. The functions are
+//        prefix_set_init, prefix_set_destroy and prefix_set_resize as
+//        above, and:
+//
+//                bool prefix_set_insert(prefix_set *set,
+//                                       const void *key);
+//                bool prefix_set_contains(prefix_set *set,
+//                                         const void *key);
+//                bool prefix_set_remove(prefix_set *set,
+//                                       const void *key);
+//                size_t prefix_set_insert_batch(prefix_set *set,
+//                                               const void *const *keys,
+//                                               size_t n,
+//                                               bool *inserted);
+//
+//        The batch insert sizes the table once and prefetches the
+//        slots of the keys HASHSET_PREFETCH_DISTANCE positions ahead.
+//        If [inserted] is not NULL, inserted[i] tells whether keys[i]
+//        was new. It returns the number of keys inserted.
+//
 //    prefix_set
 //        The hashset type
 //
@@ -52,9 +121,35 @@
 //        Returns: a non-negative position in the internal map of the
 //        closest free slot, or a negative integer on error.
 //
+//    hashset_hash_t prefix_set_hash(type key, unsigned int key_len);
+//        Returns: the hash of [key] with the hash_fn of the set.
+//
 //    int prefix_set_resize(prefix_set *set,
 //                          size_t newcap);
-//        Resizes [set] with [newcap] capacity.
+//        Resizes [set] with [newcap] capacity, a power of two that
+//        holds the keys of [set].
+//        Returns: 0 on success, or a negative integer on error.
+//
+//    int prefix_set_resize_background(prefix_set *set,
+//                                     size_t newcap);
+//        Starts resizing [set] with [newcap] capacity on a helper
+//        thread. Until the migration is done, lookups use the old
+//        table and inserts go to an overflow table with as many
+//        slots as the old one. Then the set switches to the new
+//        table, and each operation moves HASHSET_OVERFLOW_DRAIN
+//        slots of the overflow table to it until it is empty.
+//        Inserts call this when the set grows.
+//        Returns: 0 on success, or a negative integer on error.
+//        Notes: Only with HASHSET_BACKGROUND_RESIZE. Removing a key
+//        that is in the old table waits for the migration, and so
+//        does an insert once the overflow table is full. The
+//        overflow table adds up to the size of the old table to the
+//        memory used during the resize.
+//
+//    int prefix_set_resize_wait(prefix_set *set);
+//        Waits for a background resize of [set] to finish and
+//        switches to the new table. Does nothing if no resize is
+//        running.
 //        Returns: 0 on success, or a negative integer on error.
 //
 //    bool prefix_set_insert(prefix_set *set,
@@ -63,6 +158,24 @@
 //         Insert [key] element of [key_len] length in [set]
 //         Returns: true if insertion succeed, or false otherwise.
 //
+//    bool prefix_set_insert_unique(prefix_set *set,
+//                                  type key,
+//                                  unsigned int key_len);
+//         Insert [key] element of [key_len] length in [set], which
+//         must not contain it already. Faster than insert since no
+//         key is compared, useful to load deduplicated data.
+//         Returns: true if insertion succeed, or false otherwise.
+//         Notes: debug builds assert that [key] is not in [set].
+//
+//    int prefix_set_insert_unique_batch(prefix_set *set,
+//                                       const type *keys,
+//                                       const unsigned int *key_lens,
+//                                       size_t n);
+//         Insert [n] distinct [keys] of [key_lens] length, none of
+//         which is already in [set]. The set is resized at most once.
+//         [key_lens] may be NULL if the length is not used.
+//         Returns: 0 on success, or a negative integer on error.
+//
 //    bool prefix_set_contains(prefix_set *set,
 //                             type key,
 //                             unsigned int key_len);
@@ -76,6 +189,239 @@
 //          Returns: true if the key was successfully removed, or false
 //          otherwise.
 //
+//    size_t prefix_set_remove_batch(prefix_set *set,
+//                                   const type *keys,
+//                                   const unsigned int *key_lens,
+//                                   size_t n);
+//          Removes [n] [keys] of [key_lens] length from [set]. The
+//          following entries are shifted back instead of leaving
+//          tombstones. [key_lens] may be NULL if the length is not
+//          used.
+//          Returns: the number of keys removed.
+//
+//    size_t prefix_set_erase_if(prefix_set *set,
+//                               bool (*pred)(type key,
+//                                            unsigned int key_len,
+//                                            void *ctx),
+//                               void *ctx);
+//          Removes from [set] every key for which [pred] returns
+//          true, in a single pass over the table. The probe chains
+//          are compacted in the same pass, and any tombstone left by
+//          prefix_set_remove is purged.
+//          Returns: the number of keys removed.
+//
+//    bool prefix_set_sample(prefix_set *set,
+//                           uint64_t *rng,
+//                           type *key,
+//                           unsigned int *key_len);
+//          Picks a random element of [set] and stores it in [key] and
+//          [key_len], which can be NULL. [rng] is the state of the
+//          random generator, see hashset_rand. Random slots are tried
+//          first, which is uniform and takes 1 / load factor tries on
+//          average; after HASHSET_SAMPLE_TRIES misses the next element
+//          after a random slot is taken instead. That fallback is not
+//          uniform, it favours the elements that follow long runs of
+//          free slots, and it scans up to capacity / 8 words of the
+//          table, so sampling a nearly empty set is slow. Sets
+//          shrunk with HASHSET_MIN_LOAD_FACTOR rarely get there.
+//          Returns: true if an element was picked, false if [set] is
+//          empty.
+//
+//    bool prefix_set_pop(prefix_set *set,
+//                        type *key,
+//                        unsigned int *key_len);
+//          Removes any element of [set] and stores it in [key] and
+//          [key_len], which can be NULL. The search resumes from the
+//          last popped slot, so draining a set is linear.
+//          Returns: true if an element was removed, false if [set] is
+//          empty.
+//
+//    uint64_t hashset_rand(uint64_t *state);
+//          Returns the next random number of [state], which can be
+//          seeded with any value.
+//
+//    int prefix_set_reserve(prefix_set *set, size_t n);
+//          Grows [set] so that [n] keys fit without resizing.
+//          Returns: 0 on success, or a negative integer on error.
+//
+//    int prefix_set_merge_many(prefix_set *dst,
+//                              prefix_set **srcs,
+//                              size_t n,
+//                              size_t nthreads);
+//          Inserts in [dst] all the keys of the [n] sets in [srcs].
+//          [dst] is sized once for all of them. With HASHSET_THREADS,
+//          [nthreads] threads hash the keys and then insert them,
+//          each one only in its own part of the table and without
+//          locks; the few keys whose probe would cross into another
+//          part are inserted at the end.
+//          Returns: 0 on success, or a negative integer on error.
+//
+//    hashset_pool
+//        Free tables kept for reuse, so that short lived sets do not
+//        go through the allocator. A pool is not thread safe, use one
+//        per thread.
+//
+//    void hashset_pool_init(hashset_pool *pool);
+//        Initializes [pool]
+//
+//    void hashset_pool_destroy(hashset_pool *pool);
+//        Frees the tables kept in [pool], after all the sets using
+//        it have been destroyed
+//
+//    int prefix_set_init_pool(prefix_set *set, hashset_pool *pool);
+//        Like prefix_set_init, but [set] takes its tables from [pool]
+//        and gives them back when it resizes or is destroyed. Up to
+//        HASHSET_POOL_MAX_BLOCKS tables of each size are kept, and
+//        only their state bytes are cleared when they are reused.
+//        Returns: 0 on success, or a negative integer on error.
+//
+//    void prefix_set_dump_layout(prefix_set *set, FILE *out);
+//        Writes to [out] how the table of [set] is used: the lengths
+//        of the clusters of non empty slots, how far the keys are
+//        from their home slot, and heatmaps of the used slots and of
+//        the tombstones over HASHSET_DUMP_REGIONS regions. Long
+//        clusters point to a weak hash_fn, dense tombstones to many
+//        removals. During a background resize it shows the old table.
+//
+//    void hashset_trace_init(hashset_trace *trace, FILE *file);
+//        Initializes [trace] to write to [file], opened for writing
+//        in binary mode. Needs HASHSET_TRACE.
+//
+//    void prefix_set_trace(prefix_set *set, hashset_trace *trace);
+//        Records the prefix_set_insert, prefix_set_contains and
+//        prefix_set_remove calls on [set] in [trace], with the hash,
+//        key_len, result and the sizeof(type) bytes of each key, or
+//        stops recording if [trace] is NULL. The other functions that
+//        add or remove keys are recorded as the inserts and removals
+//        they make, and a traced set merges on the calling thread
+//        only. The operations of a flat combining set are recorded
+//        by the thread that applies them. Keys that are pointers,
+//        like char *, record only the pointer, replay them with
+//        "-e hash". Sets with keys of the same size can share a
+//        trace, from one thread at a time. Needs HASHSET_TRACE.
+//
+//    HASHSET_DECLARE_FLAT_COMBINING(prefix, type)
+//        Declare a thread safe wrapper of a set declared with
+//        HASHSET_DECLARE. Threads publish their operation in their
+//        own slot, and whichever thread takes the lock applies all
+//        the pending ones in a batch, hashing them with
+//        prefix_set_hash and prefetching them first. The table stays
+//        in the cache of one core instead of moving between them.
+//        Needs HASHSET_THREADS.
+//
+//    prefix_fc_set
+//        The flat combining set type, the wrapped set is [set]. Its
+//        slots are aligned to 64 bytes, allocate it with
+//        posix_memalign rather than malloc.
+//
+//    int prefix_fc_set_init(prefix_fc_set *fc);
+//        Initializes [fc]
+//        Returns: 0 on success, or a negative integer on error.
+//
+//    void prefix_fc_set_destroy(prefix_fc_set *fc);
+//        Destroys [fc]
+//
+//    int prefix_fc_set_register(prefix_fc_set *fc);
+//        Reserves a slot of [fc] for the calling thread, call it once
+//        per thread. At most HASHSET_FC_SLOTS threads can register.
+//        Returns: the slot, or a negative integer on error.
+//
+//    bool prefix_fc_set_insert(prefix_fc_set *fc, int slot,
+//                              type key, unsigned int key_len);
+//    bool prefix_fc_set_contains(prefix_fc_set *fc, int slot,
+//                                type key, unsigned int key_len);
+//    bool prefix_fc_set_remove(prefix_fc_set *fc, int slot,
+//                              type key, unsigned int key_len);
+//        Like the prefix_set functions, from the thread that owns
+//        [slot].
+//
+//    HASHSET_DECLARE_GROW_ONLY(prefix, type, hash_fn, eq_fn)
+//        Declare a concurrent set for [type] that supports only
+//        inserts and lookups, for parallel deduplication like visited
+//        sets. Threads claim a slot with a single compare and swap
+//        and there are no tombstones. When the set grows, every
+//        thread that touches it helps migrating a chunk of the old
+//        table. Old tables are freed by destroy. Needs
+//        HASHSET_THREADS.
+//
+//    prefix_gset
+//        The grow-only set type
+//
+//    int prefix_gset_init(prefix_gset *set);
+//        Initializes [set]
+//        Returns: 0 on success, or a negative integer on error.
+//
+//    void prefix_gset_destroy(prefix_gset *set);
+//        Destroys [set], no other thread may be using it
+//
+//    int prefix_gset_test_and_insert(prefix_gset *set,
+//                                    type key,
+//                                    unsigned int key_len);
+//        Inserts [key] of [key_len] length in [set] if missing.
+//        Returns: 1 if [key] was already in [set], 0 if it was
+//        inserted, or a negative integer on error.
+//
+//    bool prefix_gset_insert(prefix_gset *set,
+//                            type key,
+//                            unsigned int key_len);
+//        Returns: true if [key] was inserted, or false otherwise.
+//
+//    bool prefix_gset_contains(prefix_gset *set,
+//                              type key,
+//                              unsigned int key_len);
+//        Returns: true if [set] contains [key], or false otherwise.
+//
+//    size_t prefix_gset_size(prefix_gset *set);
+//        Returns: the number of keys in [set]
+//
+//
+//    HASHSET_DECLARE_PERSISTENT(prefix, type, hash_fn, eq_fn)
+//        Declare a persistent set for [type], an hash array mapped
+//        trie where each node has up to 32 entries or children
+//        indexed by 5 bits of the hash. An update copies only the
+//        O(log32 n) nodes on the path to the key and shares the rest
+//        with older versions, so taking a snapshot is O(1). Nodes
+//        not shared with any snapshot are changed in place, so bulk
+//        loads run without copies.
+//
+//    prefix_pset
+//        The persistent set type
+//
+//    int prefix_pset_init(prefix_pset *set);
+//        Initializes [set] as an empty set
+//        Returns: 0 on success, or a negative integer on error.
+//
+//    void prefix_pset_destroy(prefix_pset *set);
+//        Destroys [set], the nodes shared with other versions are
+//        freed by the last one
+//
+//    prefix_pset prefix_pset_snapshot(prefix_pset *set);
+//        Returns: a version of [set] that is not changed by further
+//        updates to [set], and must be destroyed too.
+//        Notes: Versions can be read and destroyed from any thread,
+//        but taking a snapshot must not race with updates to [set].
+//
+//    bool prefix_pset_insert(prefix_pset *set,
+//                            type key,
+//                            unsigned int key_len);
+//    bool prefix_pset_remove(prefix_pset *set,
+//                            type key,
+//                            unsigned int key_len);
+//    bool prefix_pset_contains(prefix_pset *set,
+//                              type key,
+//                              unsigned int key_len);
+//        Like the prefix_set functions
+//
+//    int prefix_pset_insert_batch(prefix_pset *set,
+//                                 const type *keys,
+//                                 const unsigned int *key_lens,
+//                                 size_t n);
+//        Inserts the [n] [keys] of [key_lens] length in [set].
+//        [key_lens] may be NULL if the length is not used.
+//        Returns: 0 on success, or a negative integer on error.
+//
+//    size_t prefix_pset_size(prefix_pset *set);
+//        Returns: the number of keys in [set]
 //
 // Usage
 // -----
@@ -114,6 +460,31 @@
 //
 // See full example at the end of the header.
 //
+// The benchmarks are in bench/, build them with "make bench". Each
+// tool describes its options at the top of its source file:
+//
+//    bench/bench    time and hardware counters per operation, or with
+//                   -l the latency percentiles and their outliers
+//    bench/memory   bytes per entry at steady state and at the peak of
+//                   a resize, allocated and resident
+//    bench/hasheval speed, avalanche, bucket distribution and probe
+//                   lengths of hash functions, user ones included
+//    bench/scale    throughput and fairness of the thread safe ways to
+//                   use a set, from one thread to all the CPUs
+//    bench/replay   plays back a trace recorded with HASHSET_TRACE, with
+//                   -L it shows the layout the trace leaves
+//    bench/tune     sweeps load factor, growth, initial capacity and
+//                   layout on a workload or a trace, and prints the
+//                   configuration to use as #defines
+//
+// The tools ending in _bg are built with HASHSET_BACKGROUND_RESIZE.
+//
+// The tests are in test/, "make test" builds them with the sanitizers
+// and runs them. test/sets checks every layout against a reference
+// model, once per configuration of the library, with the shrinking
+// and adaptive load policies in their builds. test/threads calls the
+// thread safe sets from several threads under ThreadSanitizer.
+//
 //
 // Code
 // ----
@@ -139,8 +510,11 @@
 extern "C" {
 #endif
 
+#include <assert.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <string.h>
 
 //
 // Configuration
@@ -156,6 +530,19 @@ extern "C" {
   #define HASHSET_MAX_LOAD_FACTOR 0.7
 #endif
 
+// Config: How many times larger a set gets when it grows, a power of
+// two. A larger factor resizes less often but leaves the table emptier
+// after each resize
+#ifndef HASHSET_GROWTH_FACTOR
+  #define HASHSET_GROWTH_FACTOR 2
+#endif
+// A factor that is not a literal, like a variable, reads as 0 here and
+// is left to the check of prefix_set_resize
+#if (HASHSET_GROWTH_FACTOR) == 1                                        \
+    || ((HASHSET_GROWTH_FACTOR) & ((HASHSET_GROWTH_FACTOR) - 1))
+  #error "hashset.h: HASHSET_GROWTH_FACTOR must be a power of two"
+#endif
+
 // Config: The type of an hash
 #ifndef HASHSET_HASH_T
   #define HASHSET_HASH_T unsigned int
@@ -174,6 +561,146 @@ extern "C" {
   #define HASHSET_FREE free
 #endif
 
+// Config: Resize the set on a helper thread when it grows. While the
+// entries are migrated, lookups keep using the old table and inserts
+// go to an overflow table, so the callers do not wait for the
+// migration. Needs POSIX threads.
+//
+//    #define HASHSET_BACKGROUND_RESIZE
+//
+
+// Config: Compare the length stored with each key to key_len before
+// calling eq_fn, so that probes skip keys of a different length
+// without comparing them. Only valid if keys of different lengths are
+// never equal, so sets that ignore key_len must pass the same value
+// every time.
+//
+//    #define HASHSET_SIZE_PREFILTER
+//
+
+// Config: Let each prefix_set pick its own maximum load factor, from
+// the probes its lookups take. Hits and misses are averaged apart,
+// each over its last HASHSET_ADAPTIVE_WINDOW lookups, since misses
+// probe until an empty slot and get longer much faster. Sets grow
+// early, from HASHSET_ADAPTIVE_MIN_LOAD, when the hits average more
+// than HASHSET_TARGET_HIT_PROBES or the misses more than
+// HASHSET_TARGET_MISS_PROBES, and fill up to HASHSET_ADAPTIVE_MAX_LOAD
+// while both stay below: sets with a good hash_fn use less memory,
+// sets with clustered hashes or many misses stay fast. With a uniform
+// hash, hits average 2 probes at 0.67 load and misses 3 probes at 0.55
+// load. HASHSET_MAX_LOAD_FACTOR is then only used by
+// prefix_set_reserve. Lookups update the statistics, so
+// prefix_set_contains writes to the set.
+//
+//    #define HASHSET_ADAPTIVE_LOAD
+//
+#ifndef HASHSET_TARGET_HIT_PROBES
+  #define HASHSET_TARGET_HIT_PROBES 2.0
+#endif
+#ifndef HASHSET_TARGET_MISS_PROBES
+  #define HASHSET_TARGET_MISS_PROBES 3.0
+#endif
+#ifndef HASHSET_ADAPTIVE_MIN_LOAD
+  #define HASHSET_ADAPTIVE_MIN_LOAD 0.5
+#endif
+#ifndef HASHSET_ADAPTIVE_MAX_LOAD
+  #define HASHSET_ADAPTIVE_MAX_LOAD 0.9
+#endif
+#ifndef HASHSET_ADAPTIVE_WINDOW
+  #define HASHSET_ADAPTIVE_WINDOW 1024
+#endif
+
+// Config: Halve the capacity of a prefix_set when a removal leaves it
+// less full than this, down to HASHSET_INITIAL_CAPACITY, and drop its
+// tombstones in the same rehash. A table is never shrunk to more than
+// half the load it grows at, so that it does not grow back and forth
+// when keys come and go around the threshold.
+//
+//    #define HASHSET_MIN_LOAD_FACTOR 0.1
+//
+
+// Config: Record the insert, contains and remove calls of the sets
+// that have a hashset_trace, to play them back later with
+// bench/replay
+//
+//    #define HASHSET_TRACE
+//
+
+// Config: Slots of the overflow table moved to the new table by each
+// operation after a background resize, until it is empty
+#ifndef HASHSET_OVERFLOW_DRAIN
+  #define HASHSET_OVERFLOW_DRAIN 16
+#endif
+
+// Config: Smaller tables are resized on the caller even with
+// HASHSET_BACKGROUND_RESIZE, starting a thread would cost more
+#ifndef HASHSET_BACKGROUND_MIN_CAPACITY
+  #define HASHSET_BACKGROUND_MIN_CAPACITY 4096
+#endif
+
+// Config: Enable the declarations that need POSIX threads, like
+// HASHSET_DECLARE_FLAT_COMBINING
+//
+//    #define HASHSET_THREADS
+//
+
+// Config: Maximum number of threads that can register to a flat
+// combining set
+#ifndef HASHSET_FC_SLOTS
+  #define HASHSET_FC_SLOTS 64
+#endif
+
+// Config: Slots migrated at a time by each thread that helps to grow
+// a grow-only set
+#ifndef HASHSET_MIGRATE_CHUNK
+  #define HASHSET_MIGRATE_CHUNK 1024
+#endif
+
+// Config: Maximum number of threads used by prefix_set_merge_many
+#ifndef HASHSET_MERGE_MAX_THREADS
+  #define HASHSET_MERGE_MAX_THREADS 64
+#endif
+
+// Config: Tables of each size kept by a hashset_pool
+#ifndef HASHSET_POOL_MAX_BLOCKS
+  #define HASHSET_POOL_MAX_BLOCKS 16
+#endif
+
+// Config: How many keys ahead batch functions prefetch the slots of
+#ifndef HASHSET_PREFETCH_DISTANCE
+  #define HASHSET_PREFETCH_DISTANCE 8
+#endif
+
+// Config: Random slots tried by prefix_set_sample before scanning
+// for the next entry, which is faster on very sparse tables
+#ifndef HASHSET_SAMPLE_TRIES
+  #define HASHSET_SAMPLE_TRIES 16
+#endif
+
+#ifdef HASHSET_BACKGROUND_RESIZE
+  #ifndef HASHSET_THREADS
+    #define HASHSET_THREADS
+  #endif
+#endif
+
+#ifdef HASHSET_THREADS
+  #ifndef __GNUC__
+    #error "hashset.h: threads support needs GCC or Clang atomic builtins"
+  #endif
+  #include <pthread.h>
+  #include <sched.h>
+#endif
+
+#ifdef __GNUC__
+  #define HASHSET_PREFETCH(addr) __builtin_prefetch(addr)
+#else
+  #define HASHSET_PREFETCH(addr) ((void) (addr))
+#endif
+
+#ifdef __SSE2__
+  #include <emmintrin.h>
+#endif
+
 typedef HASHSET_HASH_T hashset_hash_t;
 
 //
@@ -183,174 +710,3045 @@ typedef HASHSET_HASH_T hashset_hash_t;
 #define HASHSET_OK                0
 #define HASHSET_ERROR_SET_NULL   -1
 #define HASHSET_ERROR_ALLOCATION -2
-  
-#define HASHSET_DECLARE(prefix, type, hash_fn, eq_fn)                   \
-  typedef struct {                                                      \
-    type val;                                                           \
-    unsigned int size;                                                  \
-  } prefix##_##type##_size_pair;                                        \
-                                                                        \
-  typedef struct {                                                      \
-    prefix##_##type##_size_pair *data;                                  \
-    uint8_t *state; /* 0=empty,1=used,2=deleted */                      \
-    size_t size;                                                        \
-    size_t capacity;                                                    \
-  } prefix##_set;                                                       \
-                                                                        \
-  static inline int prefix##_set_init(prefix##_set *set)                \
-  {                                                                     \
-    if (!set) return HASHSET_ERROR_SET_NULL;                            \
-                                                                        \
-    set->size = 0;                                                      \
-    set->capacity = HASHSET_INITIAL_CAPACITY;                           \
-    set->data = HASHSET_CALLOC(set->capacity,                           \
-                               sizeof(prefix##_##type##_size_pair));    \
-    if (!set->data) return HASHSET_ERROR_ALLOCATION;                    \
-    set->state = HASHSET_CALLOC(set->capacity, sizeof(uint8_t));        \
-    if (!set->state) return HASHSET_ERROR_ALLOCATION;                   \
-                                                                        \
-    return HASHSET_OK;                                                  \
-  }                                                                     \
-                                                                        \
-  static inline void prefix##_set_destroy(prefix##_set *set)            \
-  {                                                                     \
-    if (!set) return;                                                   \
-                                                                        \
-    if (set->data)                                                      \
-      HASHSET_FREE(set->data);                                          \
-    if (set->state)                                                     \
-      HASHSET_FREE(set->state);                                         \
-    set->data = NULL; set->state = NULL;                                \
-    set->size = set->capacity = 0;                                      \
-                                                                        \
-    return;                                                             \
-  }                                                                     \
-                                                                        \
-  static inline size_t prefix##_set_find_slot(prefix##_set *set,        \
-                                              type key,                 \
-                                              unsigned int key_len)     \
-  {                                                                     \
-    if (!set) return HASHSET_ERROR_SET_NULL;                            \
-                                                                        \
-    size_t mask = set->capacity - 1;                                    \
-    hashset_hash_t idx = hash_fn(key, key_len) & mask;                  \
-    size_t start = idx;                                                 \
-    while (set->state[idx] == 1                                         \
-           && !eq_fn(set->data[idx].val, set->data[idx].size,           \
-                     key, key_len))                                     \
-    {                                                                   \
-      idx = (idx + 1) & mask;                                           \
-      if (idx == start) return set->capacity; /* full */                \
-    }                                                                   \
-    return idx;                                                         \
-  }                                                                     \
-                                                                        \
-  static inline int prefix##_set_resize(prefix##_set *set,              \
-                                        size_t newcap)                  \
-  {                                                                     \
-    if (!set) return HASHSET_ERROR_SET_NULL;                            \
-                                                                        \
-    prefix##_##type##_size_pair *old_data = set->data;                  \
-    uint8_t *old_state = set->state;                                    \
-    size_t old_cap = set->capacity;                                     \
-                                                                        \
-    set->capacity = newcap;                                             \
-    set->data = HASHSET_CALLOC(newcap,                                  \
-                               sizeof(prefix##_##type##_size_pair));    \
-    if (!set->data) return HASHSET_ERROR_ALLOCATION;                    \
-    set->state = HASHSET_CALLOC(newcap, sizeof(uint8_t));               \
-    if (!set->state) return HASHSET_ERROR_ALLOCATION;                   \
-    set->size = 0;                                                      \
-                                                                        \
-    for (size_t i = 0; i < old_cap; i++)                                \
-    {                                                                   \
-      if (old_state[i] == 1)                                            \
-      {                                                                 \
-        prefix##_##type##_size_pair val = old_data[i];                  \
-        size_t slot = prefix##_set_find_slot(set, val.val, val.size);   \
-        if (slot < 0) continue;                                         \
-        set->data[slot] = val;                                          \
-        set->state[slot] = 1;                                           \
-        set->size++;                                                    \
-      }                                                                 \
-    }                                                                   \
-                                                                        \
-    HASHSET_FREE(old_data);                                             \
-    HASHSET_FREE(old_state);                                            \
-    return HASHSET_OK;                                                  \
-  }                                                                     \
-                                                                        \
-  static inline bool prefix##_set_insert(prefix##_set *set,             \
-                                         type key,                      \
-                                         unsigned int key_len)          \
-  {                                                                     \
-    if (set == NULL) return false;                                      \
-    if ((double)set->size / set->capacity > HASHSET_MAX_LOAD_FACTOR)    \
-      prefix##_set_resize(set, set->capacity * 2);                      \
-                                                                        \
-    size_t idx = prefix##_set_find_slot(set, key, key_len);             \
-    if (idx< 0) return false;                                           \
-                                                                        \
-    if (set->state[idx] == 1) return false; /* already exists */        \
-    set->data[idx] =                                                    \
-      (prefix##_##type##_size_pair) {.val = key, .size = key_len};      \
-    set->state[idx] = 1;                                                \
-    set->size++;                                                        \
-                                                                        \
-    return true;                                                        \
-  }                                                                     \
-                                                                        \
-  static inline bool prefix##_set_contains(prefix##_set *set,           \
-                                           type key,                    \
-                                           unsigned int key_len)        \
-  {                                                                     \
-    if (!set) return false;                                             \
-    size_t idx = prefix##_set_find_slot(set, key, key_len);             \
-    if (idx < 0) return false;                                          \
-    return set->state[idx] == 1;                                        \
-  }                                                                     \
-                                                                        \
-  static inline bool prefix##_set_remove(prefix##_set *set,             \
-                                         type key,                      \
-                                         unsigned int key_len)          \
-  {                                                                     \
-    if (!set) return false;                                             \
-    size_t idx = prefix##_set_find_slot(set, key, key_len);             \
-    if (set->state[idx] != 1) return false;                             \
-    set->state[idx] = 2; /* mark deleted */                             \
-    set->size--;                                                        \
-    return true;                                                        \
+#define HASHSET_ERROR_FULL       -3
+
+// How keys are passed to the functions of a set, and to its hash_fn
+// and eq_fn: KEY_T is the type of the argument, KEY turns a stored
+// value into an argument, VAL an argument into a stored value and
+// BYTES an argument into a pointer to its stored value
+#define HASHSET_KEY_T_VALUE(type) type
+#define HASHSET_KEY_VALUE(val)    (val)
+#define HASHSET_VAL_VALUE(key)    (key)
+#define HASHSET_BYTES_VALUE(key)  ((const void *) &(key))
+
+#define HASHSET_KEY_T_REF(type)   const type *
+#define HASHSET_KEY_REF(val)      (&(val))
+#define HASHSET_VAL_REF(key)      (*(key))
+#define HASHSET_BYTES_REF(key)    ((const void *) (key))
+
+#ifdef HASHSET_SIZE_PREFILTER
+  #define HASHSET_SIZE_EQ(a, b) ((a) == (b))
+#else
+  #define HASHSET_SIZE_EQ(a, b) true
+#endif
+
+// Random number generator for prefix_set_sample (splitmix64), [state]
+// can be seeded with any value
+static inline uint64_t hashset_rand(uint64_t *state)
+{
+  uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+static inline unsigned int hashset_popcount(uint32_t x)
+{
+#ifdef __GNUC__
+  return (unsigned int) __builtin_popcount(x);
+#else
+  x = x - ((x >> 1) & 0x55555555);
+  x = (x & 0x33333333) + ((x >> 2) & 0x33333333);
+  return (((x + (x >> 4)) & 0x0f0f0f0f) * 0x01010101) >> 24;
+#endif
+}
+
+// Hash of [len] bytes, reading 8 of them at a time
+static inline uint64_t hashset_hash_bytes(const void *data, size_t len)
+{
+  const unsigned char *bytes = data;
+  uint64_t hash = 0x9e3779b97f4a7c15ULL ^ len;
+  uint64_t word;
+  size_t i = 0;
+  for (; i + 8 <= len; i += 8)
+  {
+    memcpy(&word, bytes + i, 8);
+    hash = (hash ^ word) * 0xbf58476d1ce4e5b9ULL;
+    hash ^= hash >> 31;
+  }
+  if (i < len)
+  {
+    word = 0;
+    memcpy(&word, bytes + i, len - i);
+    hash = (hash ^ word) * 0xbf58476d1ce4e5b9ULL;
   }
+  hash ^= hash >> 32;
+  hash *= 0x94d049bb133111ebULL;
+  return hash ^ (hash >> 29);
+}
 
-//
-// Function Declarations
-//
+static inline unsigned int hashset_ctz(uint32_t x)
+{
+#ifdef __GNUC__
+  return (unsigned int) __builtin_ctz(x);
+#else
+  unsigned int n = 0;
+  while (!(x & 1)) { x >>= 1; n++; }
+  return n;
+#endif
+}
 
-// Some sample hash functions
-// You need to #define HASHSET_IMPLEMENTATION to use them.
-  
-// char* key hash function
-// Credits to http://www.cse.yorku.ca/~oz/hash.html
-unsigned long hashset_hash_char(char *bytes, unsigned int len);
+// Control bytes of the sets probing 16 slots at a time: a fingerprint
+// of 7 bits of the hash for used slots, or one of these
+#define HASHSET_CTRL_EMPTY   0x80
+#define HASHSET_CTRL_DELETED 0xfe
+#define HASHSET_GROUP        16
 
-// uint32_t key hash function
-uint32_t hashset_hash_int32(uint32_t a, unsigned int ignored);
-  
-//
-// Implementation
-//
+// Bit i is set if the control byte i of the group is [byte]
+static inline uint32_t hashset_group_match(const uint8_t *ctrl,
+                                           uint8_t byte)
+{
+#ifdef __SSE2__
+  __m128i group = _mm_loadu_si128((const __m128i*) ctrl);
+  __m128i eq = _mm_cmpeq_epi8(group, _mm_set1_epi8((char) byte));
+  return (uint32_t) _mm_movemask_epi8(eq);
+#else
+  uint32_t mask = 0;
+  for (unsigned int i = 0; i < HASHSET_GROUP; ++i)
+    mask |= (uint32_t) (ctrl[i] == byte) << i;
+  return mask;
+#endif
+}
 
-#ifdef HASHSET_IMPLEMENTATION
+// Bit i is set if the slot i of the group is empty or deleted
+static inline uint32_t hashset_group_free(const uint8_t *ctrl)
+{
+#ifdef __SSE2__
+  __m128i group = _mm_loadu_si128((const __m128i*) ctrl);
+  return (uint32_t) _mm_movemask_epi8(group);
+#else
+  uint32_t mask = 0;
+  for (unsigned int i = 0; i < HASHSET_GROUP; ++i)
+    mask |= (uint32_t) (ctrl[i] >> 7) << i;
+  return mask;
+#endif
+}
 
-unsigned long hashset_hash_char(char *bytes, unsigned int len)
+typedef struct {
+  uint64_t lo, hi;
+} hashset_u128;
+
+static inline bool hashset_u128_eq(hashset_u128 a, hashset_u128 b)
 {
-  unsigned long hash = 5381;
-  for (unsigned int i = 0; i < len; ++i)
-    hash = hash * 33 + bytes[i];
-  return hash;
+#ifdef __SSE2__
+  __m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) &a),
+                              _mm_loadu_si128((const __m128i*) &b));
+  return _mm_movemask_epi8(eq) == 0xffff;
+#else
+  return a.lo == b.lo && a.hi == b.hi;
+#endif
 }
 
-uint32_t hashset_hash_int32(uint32_t a, unsigned int ignored)
+// The keys are expected to be random already, like UUIDs
+static inline uint64_t hashset_hash_u128(hashset_u128 key)
+{
+  uint64_t hash = key.lo * 0x9e3779b97f4a7c15ULL ^ key.hi;
+  return hash ^ (hash >> 32);
+}
+
+// Pointers are aligned to at least 8 bytes, their low bits are zero
+static inline uint64_t hashset_hash_ptr(const void *ptr)
+{
+  uint64_t hash = ((uint64_t) (uintptr_t) ptr >> 3) * 0x9e3779b97f4a7c15ULL;
+  return hash ^ (hash >> 32);
+}
+
+// Free tables of a thread, by the log2 of their size in bytes
+#define HASHSET_POOL_CLASSES 64
+
+typedef struct hashset_pool_block {
+  struct hashset_pool_block *next;
+  size_t size;
+} hashset_pool_block;
+
+typedef struct {
+  hashset_pool_block *free[HASHSET_POOL_CLASSES];
+  size_t len[HASHSET_POOL_CLASSES];
+} hashset_pool;
+
+static inline void hashset_pool_init(hashset_pool *pool)
+{
+  if (pool) *pool = (hashset_pool){0};
+}
+
+static inline void hashset_pool_destroy(hashset_pool *pool)
+{
+  if (!pool) return;
+  for (unsigned int c = 0; c < HASHSET_POOL_CLASSES; ++c)
+    while (pool->free[c])
+    {
+      hashset_pool_block *block = pool->free[c];
+      pool->free[c] = block->next;
+      HASHSET_FREE(block);
+    }
+  *pool = (hashset_pool){0};
+}
+
+static inline unsigned int hashset_pool_class(size_t *size)
+{
+  if (*size < sizeof(hashset_pool_block))
+    *size = sizeof(hashset_pool_block);
+  unsigned int c = 0;
+  for (size_t n = *size; n >>= 1;) c++;
+  return c;
+}
+
+// Takes a table of [n] items of [size] bytes from [pool], or from the
+// allocator if there is none. Only tables asked with [zero] are
+// cleared on reuse.
+static inline void *hashset_pool_alloc(hashset_pool *pool,
+                                       size_t n, size_t size,
+                                       bool zero)
+{
+  // Like calloc, fail rather than allocate a wrapped around size
+  if (size && n > SIZE_MAX / size) return NULL;
+  size *= n;
+  if (!pool) return HASHSET_CALLOC(1, size);
+
+  unsigned int c = hashset_pool_class(&size);
+  for (hashset_pool_block **b = &pool->free[c]; *b; b = &(*b)->next)
+  {
+    if ((*b)->size != size) continue;
+    void *ptr = *b;
+    *b = (*b)->next;
+    pool->len[c]--;
+    if (zero) memset(ptr, 0, size);
+    return ptr;
+  }
+  return HASHSET_CALLOC(1, size);
+}
+
+static inline void hashset_pool_free(hashset_pool *pool,
+                                     void *ptr,
+                                     size_t size)
+{
+  if (!ptr) return;
+  unsigned int c = hashset_pool_class(&size);
+  if (!pool || pool->len[c] >= HASHSET_POOL_MAX_BLOCKS)
+  {
+    HASHSET_FREE(ptr);
+    return;
+  }
+  hashset_pool_block *block = ptr;
+  block->size = size;
+  block->next = pool->free[c];
+  pool->free[c] = block;
+  pool->len[c]++;
+}
+
+// Reference counts of nodes shared between versions of a set
+static inline uint32_t hashset_ref_get(uint32_t *refs)
+{
+#ifdef __GNUC__
+  return __atomic_load_n(refs, __ATOMIC_ACQUIRE);
+#else
+  return *refs;
+#endif
+}
+
+static inline void hashset_ref_inc(uint32_t *refs)
+{
+#ifdef __GNUC__
+  __atomic_add_fetch(refs, 1, __ATOMIC_RELAXED);
+#else
+  (*refs)++;
+#endif
+}
+
+static inline uint32_t hashset_ref_dec(uint32_t *refs)
+{
+#ifdef __GNUC__
+  return __atomic_sub_fetch(refs, 1, __ATOMIC_ACQ_REL);
+#else
+  return --(*refs);
+#endif
+}
+
+// Buckets of the histograms of prefix_set_dump_layout: 0, 1, 2-3,
+// 4-7 and so on
+#define HASHSET_DUMP_BUCKETS 65
+// Regions of the heatmaps of prefix_set_dump_layout
+#define HASHSET_DUMP_REGIONS 64
+
+static inline unsigned int hashset_dump_bucket(size_t n)
+{
+  unsigned int b = 0;
+  while (n) n >>= 1, b++;
+  return b;
+}
+
+static inline void hashset_dump_histogram(FILE *out, const char *title,
+                                          const size_t *count)
+{
+  size_t max = 0;
+  for (unsigned int b = 0; b < HASHSET_DUMP_BUCKETS; ++b)
+    if (count[b] > max) max = count[b];
+  fprintf(out, "%s\n", title);
+  for (unsigned int b = 0; b < HASHSET_DUMP_BUCKETS; ++b)
+  {
+    if (!count[b]) continue;
+    size_t lo = b ? (size_t) 1 << (b - 1) : 0;
+    size_t hi = b ? ((size_t) 1 << (b - 1)) * 2 - 1 : 0;
+    char range[48];
+    if (lo == hi) snprintf(range, sizeof(range), "%zu", lo);
+    else snprintf(range, sizeof(range), "%zu-%zu", lo, hi);
+    fprintf(out, "  %-14s %10zu ", range, count[b]);
+    for (size_t i = 0; i < (count[b] * 40 + max - 1) / max; ++i)
+      fputc('#', out);
+    fputc('\n', out);
+  }
+}
+
+// One character per region, from ' ' for none of its [slots] to '@'
+// for all of them
+static inline void hashset_dump_heatmap(FILE *out, const char *title,
+                                        const size_t *count,
+                                        size_t regions, size_t slots)
+{
+  static const char ramp[] = " .:-=+*#%@";
+  fprintf(out, "%s\n  [", title);
+  for (size_t r = 0; r < regions; ++r)
+    fputc(ramp[slots ? count[r] * 9 / slots : 0], out);
+  fprintf(out, "]\n");
+}
+
+// The trace format, defined without HASHSET_TRACE too for the tools
+// that read traces
+
+#define HASHSET_TRACE_MAGIC   0x52545348 // "HSTR" in little endian
+#define HASHSET_TRACE_VERSION 1
+
+#define HASHSET_TRACE_INSERT   1
+#define HASHSET_TRACE_CONTAINS 2
+#define HASHSET_TRACE_REMOVE   3
+
+// A trace file starts with a header, then each call is a record
+// followed by the key_size bytes of its key, in host byte order
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t key_size;
+  uint32_t hash_size;
+} hashset_trace_header;
+
+typedef struct {
+  uint64_t hash;
+  uint32_t key_len;
+  uint8_t op;
+  uint8_t result;
+  uint8_t pad[2];
+} hashset_trace_record;
+
+#ifdef HASHSET_TRACE
+
+typedef struct {
+  FILE *file;
+  size_t key_size; // of the first key written, 0 before
+  uint64_t records;
+  uint64_t dropped; // keys of another size, or failed writes
+} hashset_trace;
+
+static inline void hashset_trace_init(hashset_trace *trace, FILE *file)
+{
+  if (trace) *trace = (hashset_trace) {.file = file};
+}
+
+static inline void hashset_trace_write(hashset_trace *trace, int op,
+                                       const void *key, size_t key_size,
+                                       unsigned int key_len,
+                                       hashset_hash_t hash, bool result)
+{
+  if (!trace || !trace->file) return;
+  if (!trace->key_size)
+  {
+    hashset_trace_header header = {
+      .magic = HASHSET_TRACE_MAGIC,
+      .version = HASHSET_TRACE_VERSION,
+      .key_size = (uint32_t) key_size,
+      .hash_size = sizeof(hashset_hash_t),
+    };
+    if (fwrite(&header, sizeof(header), 1, trace->file) != 1)
+    {
+      trace->dropped++;
+      return;
+    }
+    trace->key_size = key_size;
+  }
+  if (key_size != trace->key_size)
+  {
+    trace->dropped++;
+    return;
+  }
+
+  hashset_trace_record record = {
+    .hash = hash,
+    .key_len = key_len,
+    .op = (uint8_t) op,
+    .result = result,
+  };
+  if (fwrite(&record, sizeof(record), 1, trace->file) == 1
+      && fwrite(key, key_size, 1, trace->file) == 1)
+    trace->records++;
+  else
+    trace->dropped++;
+}
+
+#define HASHSET_TRACE_FIELDS hashset_trace *trace;
+
+// The arguments, like the hash, are only computed for traced sets
+#define HASHSET_TRACE_CALL(set, op, key, size, len, hash, ret)          \
+  ((set)->trace                                                         \
+   ? hashset_trace_write((set)->trace, op, key, size, len, hash, ret)   \
+   : (void) 0)
+
+#define HASHSET_TRACING(set) ((set)->trace != NULL)
+
+#define HASHSET_DECLARE_TRACE(prefix)                                   \
+  static inline void prefix##_set_trace(prefix##_set *set,              \
+                                        hashset_trace *trace)           \
+  {                                                                     \
+    if (set) set->trace = trace;                                        \
+  }
+
+#else
+
+#define HASHSET_TRACE_FIELDS
+#define HASHSET_TRACE_CALL(set, op, key, size, len, hash, ret)          \
+  ((void) 0)
+#define HASHSET_TRACING(set) false
+#define HASHSET_DECLARE_TRACE(prefix)
+
+#endif // HASHSET_TRACE
+
+#ifdef HASHSET_ADAPTIVE_LOAD
+
+// Probes taken by the lookups of one kind, hits or misses
+typedef struct {
+  size_t lookups; // in the current window
+  size_t probes;  // in the current window
+  double average; // probes per lookup of the last full window
+} hashset_probe_window;
+
+// Probes taken by the lookups of a set since its last resize
+typedef struct {
+  hashset_probe_window hits;
+  hashset_probe_window misses;
+} hashset_adaptive;
+
+static inline void hashset_adaptive_count(hashset_adaptive *a,
+                                          size_t probes, bool hit)
+{
+  hashset_probe_window *w = hit ? &a->hits : &a->misses;
+  w->probes += probes;
+  if (++w->lookups < HASHSET_ADAPTIVE_WINDOW) return;
+  w->average = (double) w->probes / w->lookups;
+  w->probes = w->lookups = 0;
+}
+
+static inline bool hashset_adaptive_over(hashset_adaptive *a,
+                                         size_t size, size_t capacity)
+{
+  double load = (double) size / capacity;
+  if (load > HASHSET_ADAPTIVE_MAX_LOAD) return true;
+  return load > HASHSET_ADAPTIVE_MIN_LOAD
+    && (a->hits.average > HASHSET_TARGET_HIT_PROBES
+        || a->misses.average > HASHSET_TARGET_MISS_PROBES);
+}
+
+#define HASHSET_ADAPTIVE_FIELDS hashset_adaptive adaptive;
+
+#define HASHSET_ADAPTIVE_COUNT(set, probes, hit)                        \
+  hashset_adaptive_count(&(set)->adaptive, probes, hit)
+
+// The statistics of the old table say nothing of the new one
+#define HASHSET_ADAPTIVE_RESET(set)                                     \
+  ((set)->adaptive = (hashset_adaptive) {0})
+
+#define HASHSET_OVER_LOAD(set, size, capacity)                          \
+  hashset_adaptive_over(&(set)->adaptive, size, capacity)
+
+// The lowest load a set can grow at
+#define HASHSET_GROW_LOAD HASHSET_ADAPTIVE_MIN_LOAD
+
+#else
+
+#define HASHSET_ADAPTIVE_FIELDS
+#define HASHSET_ADAPTIVE_COUNT(set, probes, hit) ((void) 0)
+#define HASHSET_ADAPTIVE_RESET(set) ((void) 0)
+#define HASHSET_OVER_LOAD(set, size, capacity)                          \
+  ((double) (size) / (capacity) > HASHSET_MAX_LOAD_FACTOR)
+#define HASHSET_GROW_LOAD HASHSET_MAX_LOAD_FACTOR
+
+#endif // HASHSET_ADAPTIVE_LOAD
+
+#ifdef HASHSET_MIN_LOAD_FACTOR
+  #define HASHSET_UNDER_LOAD(size, capacity)                            \
+    ((capacity) > HASHSET_INITIAL_CAPACITY                              \
+     && (double) (size) / (capacity) < HASHSET_MIN_LOAD_FACTOR          \
+     && (double) (size) / ((capacity) / 2) <= HASHSET_GROW_LOAD / 2)
+#else
+  #define HASHSET_UNDER_LOAD(size, capacity) false
+#endif
+
+#ifdef HASHSET_BACKGROUND_RESIZE
+
+#define HASHSET_BACKGROUND_FIELDS(prefix, type)                         \
+  struct {                                                              \
+    pthread_t thread;                                                   \
+    int running;  /* a helper thread owns the migration */              \
+    int done;     /* set by the helper thread when finished */          \
+    prefix##_##type##_size_pair *data;                                  \
+    uint8_t *state;                                                     \
+    size_t capacity;                                                    \
+    /* Keys inserted during the migration, until they are moved */      \
+    /* to the new table a few slots per operation */                    \
+    prefix##_##type##_size_pair *overflow;                              \
+    uint8_t *overflow_state;                                            \
+    size_t overflow_cap;                                                \
+    size_t overflow_used; /* slots used or deleted */                   \
+    size_t overflow_next; /* next slot to move */                       \
+  } bg;
+
+#define HASHSET_DECLARE_BACKGROUND_RESIZE(prefix, type, pass,           \
+                                          hash_fn, eq_fn)               \
+  static void *prefix##_set_resize_worker(void *arg)                    \
+  {                                                                     \
+    prefix##_set *set = arg;                                            \
+    prefix##_set_migrate(set->bg.data, set->bg.state, set->bg.capacity, \
+                         set->data, set->state, set->capacity);         \
+    __atomic_store_n(&set->bg.done, 1, __ATOMIC_RELEASE);               \
+    return NULL;                                                        \
+  }                                                                     \
+                                                                        \
+  /* Moves the keys of up to [slots] overflow slots to the table, */    \
+  /* and drops the overflow table once it is empty */                   \
+  static inline void prefix##_set_bg_drain(prefix##_set *set,           \
+                                           size_t slots)                \
+  {                                                                     \
+    size_t end = set->bg.overflow_cap - set->bg.overflow_next;          \
+    end = set->bg.overflow_next + (slots < end ? slots : end);          \
+    for (size_t i = set->bg.overflow_next; i < end; ++i)                \
+    {                                                                   \
+      if (set->bg.overflow_state[i] != 1) continue;                     \
+      prefix##_set_place(set->data, set->state, set->capacity,          \
+                         set->bg.overflow[i]);                          \
+      /* A tombstone keeps the probes of the other keys going */        \
+      set->bg.overflow_state[i] = 2;                                    \
+    }                                                                   \
+    set->bg.overflow_next = end;                                        \
+    if (end < set->bg.overflow_cap) return;                             \
+                                                                        \
+    prefix##_set_table_free(set, set->bg.overflow_cap,                  \
+                            set->bg.overflow, set->bg.overflow_state);  \
+    set->bg.overflow = NULL;                                            \
+    set->bg.overflow_state = NULL;                                      \
+    set->bg.overflow_cap = 0;                                           \
+  }                                                                     \
+                                                                        \
+  /* Switches to the new table once the helper thread is done */        \
+  static inline void prefix##_set_bg_switch(prefix##_set *set)          \
+  {                                                                     \
+    pthread_join(set->bg.thread, NULL);                                 \
+    prefix##_set_table_free(set, set->capacity, set->data, set->state); \
+    set->data = set->bg.data;                                           \
+    set->state = set->bg.state;                                         \
+    set->capacity = set->bg.capacity;                                   \
+    set->bg.running = 0;                                                \
+    set->bg.overflow_next = 0;                                          \
+    HASHSET_ADAPTIVE_RESET(set);                                        \
+  }                                                                     \
+                                                                        \
+  static inline int prefix##_set_resize_wait(prefix##_set *set)         \
+  {                                                                     \
+    if (!set) return HASHSET_ERROR_SET_NULL;                            \
+    if (set->bg.running) prefix##_set_bg_switch(set);                   \
+    if (set->bg.overflow) prefix##_set_bg_drain(set, SIZE_MAX);         \
+    return HASHSET_OK;                                                  \
+  }                                                                     \
+                                                                        \
+  /* True while a helper thread migrates the table, or while the */     \
+  /* overflow table still holds keys */                                 \
+  static inline bool prefix##_set_bg_active(prefix##_set *set)          \
+  {                                                                     \
+    if (set->bg.running)                                                \
+    {                                                                   \
+      if (!__atomic_load_n(&set->bg.done, __ATOMIC_ACQUIRE))            \
+        return true;                                                    \
+      prefix##_set_bg_switch(set);                                      \
+    }                                                                   \
+    if (!set->bg.overflow) return false;                                \
+    prefix##_set_bg_drain(set, HASHSET_OVERFLOW_DRAIN);                 \
+    return set->bg.overflow != NULL;                                    \
+  }                                                                     \
+                                                                        \
+  static inline int prefix##_set_resize_background(prefix##_set *set,   \
+                                                   size_t newcap)       \
+  {                                                                     \
+    if (!set) return HASHSET_ERROR_SET_NULL;                            \
+    if (!newcap || (newcap & (newcap - 1)) || newcap < set->size)       \
+      return HASHSET_ERROR_FULL;                                        \
+    prefix##_set_resize_wait(set);                                      \
+    if (newcap < HASHSET_BACKGROUND_MIN_CAPACITY)                       \
+      return prefix##_set_resize(set, newcap);                          \
+                                                                        \
+    if (prefix##_set_table_new(set, newcap, &set->bg.data,              \
+                               &set->bg.state) != HASHSET_OK)           \
+      return prefix##_set_resize(set, newcap);                          \
+    set->bg.capacity = newcap;                                          \
+    set->bg.done = 0;                                                   \
+    /* As many slots as the old table, for the inserts that come */     \
+    /* while it is migrated */                                          \
+    set->bg.overflow_cap = set->capacity;                               \
+    set->bg.overflow_used = 0;                                          \
+    if (prefix##_set_table_new(set, set->bg.overflow_cap,               \
+                               &set->bg.overflow,                       \
+                               &set->bg.overflow_state) == HASHSET_OK)  \
+    {                                                                   \
+      if (pthread_create(&set->bg.thread, NULL,                         \
+                         prefix##_set_resize_worker, set) == 0)         \
+      {                                                                 \
+        set->bg.running = 1;                                            \
+        HASHSET_ADAPTIVE_RESET(set);                                    \
+        return HASHSET_OK;                                              \
+      }                                                                 \
+      prefix##_set_table_free(set, set->bg.overflow_cap,                \
+                              set->bg.overflow,                         \
+                              set->bg.overflow_state);                  \
+    }                                                                   \
+                                                                        \
+    /* No helper thread, resize on the caller instead */                \
+    prefix##_set_table_free(set, newcap, set->bg.data, set->bg.state);  \
+    set->bg.data = set->bg.overflow = NULL;                             \
+    set->bg.state = set->bg.overflow_state = NULL;                      \
+    set->bg.overflow_cap = 0;                                           \
+    return prefix##_set_resize(set, newcap);                            \
+  }                                                                     \
+                                                                        \
+  static inline int prefix##_set_grow(prefix##_set *set)                \
+  {                                                                     \
+    return prefix##_set_resize_background(set,                          \
+             set->capacity * HASHSET_GROWTH_FACTOR);                    \
+  }                                                                     \
+                                                                        \
+  /* The overflow slot of [key], or where it would go */                \
+  static inline size_t prefix##_set_bg_find(prefix##_set *set,          \
+                                            prefix##_set_key key,       \
+                                            unsigned int key_len,       \
+                                            hashset_hash_t hash,        \
+                                            bool *found)                \
+  {                                                                     \
+    size_t mask = set->bg.overflow_cap - 1;                             \
+    size_t idx = hash & mask;                                           \
+    size_t deleted = set->bg.overflow_cap;                              \
+    *found = false;                                                     \
+    for (size_t n = 0; n < set->bg.overflow_cap; ++n)                   \
+    {                                                                   \
+      uint8_t st = set->bg.overflow_state[idx];                         \
+      if (st == 0) break;                                               \
+      if (st == 2)                                                      \
+      {                                                                 \
+        if (deleted == set->bg.overflow_cap) deleted = idx;             \
+      }                                                                 \
+      else if (HASHSET_SIZE_EQ(set->bg.overflow[idx].size, key_len)     \
+               && eq_fn(HASHSET_KEY_##pass(set->bg.overflow[idx].val),  \
+                        set->bg.overflow[idx].size, key, key_len))      \
+      {                                                                 \
+        *found = true;                                                  \
+        return idx;                                                     \
+      }                                                                 \
+      idx = (idx + 1) & mask;                                           \
+    }                                                                   \
+    return deleted < set->bg.overflow_cap ? deleted : idx;              \
+  }                                                                     \
+                                                                        \
+  static inline bool prefix##_set_bg_contains(prefix##_set *set,        \
+                                              prefix##_set_key key,     \
+                                              unsigned int key_len,     \
+                                              hashset_hash_t hash)      \
+  {                                                                     \
+    size_t idx =                                                        \
+      prefix##_set_find_slot_hashed(set, key, key_len, hash);           \
+    if (idx < set->capacity && set->state[idx] == 1) return true;       \
+    bool found;                                                         \
+    prefix##_set_bg_find(set, key, key_len, hash, &found);              \
+    return found;                                                       \
+  }                                                                     \
+                                                                        \
+  static inline bool prefix##_set_bg_insert(prefix##_set *set,          \
+                                            prefix##_set_key key,       \
+                                            unsigned int key_len,       \
+                                            hashset_hash_t hash)        \
+  {                                                                     \
+    bool found;                                                         \
+    size_t o = prefix##_set_bg_find(set, key, key_len, hash, &found);   \
+    if (found) return false;                                            \
+    /* Once migrated, the new table takes the inserts again */          \
+    if (!set->bg.running)                                               \
+      return prefix##_set_insert_table(set, key, key_len, hash);        \
+                                                                        \
+    size_t idx =                                                        \
+      prefix##_set_find_slot_hashed(set, key, key_len, hash);           \
+    if (idx < set->capacity && set->state[idx] == 1) return false;      \
+    if ((set->bg.overflow_state[o] == 0                                 \
+         && (double) (set->bg.overflow_used + 1) / set->bg.overflow_cap \
+            > HASHSET_MAX_LOAD_FACTOR)                                  \
+        || HASHSET_OVER_LOAD(set, set->size + 1, set->bg.capacity))     \
+    {                                                                   \
+      prefix##_set_resize_wait(set);                                    \
+      return prefix##_set_insert_hashed(set, key, key_len, hash);       \
+    }                                                                   \
+    if (set->bg.overflow_state[o] == 0) set->bg.overflow_used++;        \
+    set->bg.overflow[o] =                                               \
+      (prefix##_##type##_size_pair) {.val = HASHSET_VAL_##pass(key),    \
+                                     .size = key_len};                  \
+    set->bg.overflow_state[o] = 1;                                      \
+    set->size++;                                                        \
+    return true;                                                        \
+  }                                                                     \
+                                                                        \
+  static inline bool prefix##_set_bg_remove(prefix##_set *set,          \
+                                            prefix##_set_key key,       \
+                                            unsigned int key_len,       \
+                                            hashset_hash_t hash)        \
+  {                                                                     \
+    bool found;                                                         \
+    size_t o = prefix##_set_bg_find(set, key, key_len, hash, &found);   \
+    if (found)                                                          \
+    {                                                                   \
+      set->bg.overflow_state[o] = 2;                                    \
+      set->size--;                                                      \
+      return true;                                                      \
+    }                                                                   \
+    if (!set->bg.running)                                               \
+      return prefix##_set_remove_table(set, key, key_len, hash);        \
+                                                                        \
+    /* Reading the old table is safe, a missing key needs no wait */    \
+    size_t idx =                                                        \
+      prefix##_set_find_slot_hashed(set, key, key_len, hash);           \
+    if (idx >= set->capacity || set->state[idx] != 1) return false;     \
+    /* The old table is read by the helper thread, wait for it */       \
+    prefix##_set_resize_wait(set);                                      \
+    return prefix##_set_remove_table(set, key, key_len, hash);          \
+  }
+
+#else
+
+#define HASHSET_BACKGROUND_FIELDS(prefix, type)
+
+#define HASHSET_DECLARE_BACKGROUND_RESIZE(prefix, type, pass,           \
+                                          hash_fn, eq_fn)               \
+  static inline int prefix##_set_resize_wait(prefix##_set *set)         \
+  {                                                                     \
+    return set ? HASHSET_OK : HASHSET_ERROR_SET_NULL;                   \
+  }                                                                     \
+                                                                        \
+  static inline bool prefix##_set_bg_active(prefix##_set *set)          \
+  {                                                                     \
+    (void) set;                                                         \
+    return false;                                                       \
+  }                                                                     \
+                                                                        \
+  static inline int prefix##_set_grow(prefix##_set *set)                \
+  {                                                                     \
+    return prefix##_set_resize(set,                                     \
+             set->capacity * HASHSET_GROWTH_FACTOR);                    \
+  }                                                                     \
+                                                                        \
+  static inline bool prefix##_set_bg_contains(prefix##_set *set,        \
+                                              prefix##_set_key key,     \
+                                              unsigned int key_len,     \
+                                              hashset_hash_t hash)      \
+  {                                                                     \
+    (void) set; (void) key; (void) key_len; (void) hash;                \
+    return false;                                                       \
+  }                                                                     \
+                                                                        \
+  static inline bool prefix##_set_bg_insert(prefix##_set *set,          \
+                                            prefix##_set_key key,       \
+                                            unsigned int key_len,       \
+                                            hashset_hash_t hash)        \
+  {                                                                     \
+    (void) set; (void) key; (void) key_len; (void) hash;                \
+    return false;                                                       \
+  }                                                                     \
+                                                                        \
+  static inline bool prefix##_set_bg_remove(prefix##_set *set,          \
+                                            prefix##_set_key key,       \
+                                            unsigned int key_len,       \
+                                            hashset_hash_t hash)        \
+  {                                                                     \
+    (void) set; (void) key; (void) key_len; (void) hash;                \
+    return false;                                                       \
+  }
+
+#endif // HASHSET_BACKGROUND_RESIZE
+
+#ifdef HASHSET_THREADS
+
+#define HASHSET_DECLARE_MERGE(prefix, type, pass, hash_fn, eq_fn)       \
+  typedef struct prefix##_set_merge_job {                               \
+    prefix##_set *dst;                                                  \
+    prefix##_set **srcs;                                                \
+    size_t n;                                                           \
+    hashset_hash_t *hashes; /* of every source slot, back to back */    \
+    struct prefix##_set_merge_job *jobs; /* of every thread */          \
+    size_t id, nthreads;                                                \
+    int phase;              /* 0=hash the sources, 1=insert */          \
+    size_t begin, end;      /* source slots, then destination slots */  \
+    size_t *keys;           /* own source slots, by home region */      \
+    /* where the keys of each home region start in keys */              \
+    size_t region[HASHSET_MERGE_MAX_THREADS + 1];                       \
+    size_t *spill;          /* keys whose probe leaves the region */    \
+    size_t spill_len, spill_cap;                                        \
+    size_t added;                                                       \
+    int error;                                                          \
+  } prefix##_set_merge_job;                                             \
+                                                                        \
+  /* The thread whose part of the table the key of [flat] goes to */    \
+  static inline size_t                                                  \
+  prefix##_set_merge_home(prefix##_set_merge_job *job, size_t flat)     \
+  {                                                                     \
+    size_t mask = job->dst->capacity - 1;                               \
+    size_t home = (job->hashes[flat] & mask)                            \
+                  / (job->dst->capacity / job->nthreads);               \
+    return home < job->nthreads ? home : job->nthreads - 1;             \
+  }                                                                     \
+                                                                        \
+  static inline void                                                    \
+  prefix##_set_merge_region(prefix##_set_merge_job *job,                \
+                            prefix##_set *src,                          \
+                            size_t i,                                   \
+                            size_t flat)                                \
+  {                                                                     \
+    prefix##_set *dst = job->dst;                                       \
+    size_t idx = job->hashes[flat] & (dst->capacity - 1);               \
+                                                                        \
+    /* Like find_slot, but never leave the region of this thread */     \
+    size_t deleted = dst->capacity;                                     \
+    for (; idx < job->end; ++idx)                                       \
+    {                                                                   \
+      if (dst->state[idx] == 0) break;                                  \
+      if (dst->state[idx] == 2)                                         \
+      {                                                                 \
+        if (deleted == dst->capacity) deleted = idx;                    \
+      }                                                                 \
+      else if (HASHSET_SIZE_EQ(dst->data[idx].size, src->data[i].size)  \
+               && eq_fn(HASHSET_KEY_##pass(dst->data[idx].val),         \
+                     dst->data[idx].size,                               \
+                        HASHSET_KEY_##pass(src->data[i].val),           \
+                        src->data[i].size))                             \
+        return; /* already there */                                     \
+    }                                                                   \
+                                                                        \
+    /* The key may still be past the region, let the caller decide */   \
+    if (idx == job->end)                                                \
+    {                                                                   \
+      if (job->spill_len == job->spill_cap)                             \
+      {                                                                 \
+        size_t cap = job->spill_cap ? job->spill_cap * 2 : 64;          \
+        size_t *spill = HASHSET_CALLOC(cap, sizeof(size_t));            \
+        if (!spill)                                                     \
+        {                                                               \
+          job->error = HASHSET_ERROR_ALLOCATION;                        \
+          return;                                                       \
+        }                                                               \
+        if (job->spill)                                                 \
+        {                                                               \
+          memcpy(spill, job->spill, job->spill_len * sizeof(size_t));   \
+          HASHSET_FREE(job->spill);                                     \
+        }                                                               \
+        job->spill = spill;                                             \
+        job->spill_cap = cap;                                           \
+      }                                                                 \
+      job->spill[job->spill_len++] = flat;                              \
+      return;                                                           \
+    }                                                                   \
+    if (deleted < dst->capacity) idx = deleted;                         \
+                                                                        \
+    dst->data[idx] = src->data[i];                                      \
+    dst->state[idx] = 1;                                                \
+    job->added++;                                                       \
+  }                                                                     \
+                                                                        \
+  /* Hash our own source slots, then group them by home region, */      \
+  /* so that each thread reads only the keys it inserts */              \
+  static inline void                                                    \
+  prefix##_set_merge_hash(prefix##_set_merge_job *job)                  \
+  {                                                                     \
+    size_t next[HASHSET_MERGE_MAX_THREADS] = {0};                       \
+    for (int round = 0; round < 2; ++round)                             \
+    {                                                                   \
+      size_t flat = 0;                                                  \
+      for (size_t j = 0; j < job->n && flat < job->end; ++j)            \
+      {                                                                 \
+        prefix##_set *src = job->srcs[j];                               \
+        size_t i = job->begin > flat ? job->begin - flat : 0;           \
+        size_t end = job->end - flat < src->capacity                    \
+          ? job->end - flat : src->capacity;                            \
+        for (; i < end; ++i)                                            \
+        {                                                               \
+          if (src->state[i] != 1) continue;                             \
+          if (round == 0)                                               \
+          {                                                             \
+            job->hashes[flat + i] =                                     \
+              hash_fn(HASHSET_KEY_##pass(src->data[i].val),             \
+                      src->data[i].size);                               \
+            job->region[prefix##_set_merge_home(job, flat + i) + 1]++;  \
+          }                                                             \
+          else                                                          \
+            job->keys[next[prefix##_set_merge_home(job, flat + i)]++] = \
+              flat + i;                                                 \
+        }                                                               \
+        flat += src->capacity;                                          \
+      }                                                                 \
+      if (round == 1) break;                                            \
+                                                                        \
+      for (size_t t = 0; t < job->nthreads; ++t)                        \
+      {                                                                 \
+        job->region[t + 1] += job->region[t];                           \
+        next[t] = job->region[t];                                       \
+      }                                                                 \
+      job->keys = HASHSET_CALLOC(job->region[job->nthreads]             \
+                                 ? job->region[job->nthreads] : 1,      \
+                                 sizeof(size_t));                       \
+      if (!job->keys)                                                   \
+      {                                                                 \
+        job->error = HASHSET_ERROR_ALLOCATION;                          \
+        return;                                                         \
+      }                                                                 \
+    }                                                                   \
+  }                                                                     \
+                                                                        \
+  static void *prefix##_set_merge_worker(void *arg)                     \
+  {                                                                     \
+    prefix##_set_merge_job *job = arg;                                  \
+    if (job->phase == 0)                                                \
+    {                                                                   \
+      prefix##_set_merge_hash(job);                                     \
+      return NULL;                                                      \
+    }                                                                   \
+                                                                        \
+    /* Lower threads hashed lower source slots, so the keys, and */     \
+    /* the spills, still come in source order */                        \
+    for (size_t u = 0; u < job->nthreads; ++u)                          \
+    {                                                                   \
+      prefix##_set_merge_job *from = &job->jobs[u];                     \
+      size_t flat = 0, j = 0;                                           \
+      for (size_t k = from->region[job->id];                            \
+           k < from->region[job->id + 1]; ++k)                          \
+      {                                                                 \
+        size_t key = from->keys[k];                                     \
+        while (key >= flat + job->srcs[j]->capacity)                    \
+          flat += job->srcs[j++]->capacity;                             \
+        prefix##_set_merge_region(job, job->srcs[j], key - flat, key);  \
+      }                                                                 \
+    }                                                                   \
+    return NULL;                                                        \
+  }                                                                     \
+                                                                        \
+  static inline int                                                     \
+  prefix##_set_merge_run(prefix##_set_merge_job *jobs,                  \
+                         size_t nthreads,                               \
+                         size_t total)                                  \
+  {                                                                     \
+    pthread_t threads[HASHSET_MERGE_MAX_THREADS];                       \
+    bool started[HASHSET_MERGE_MAX_THREADS] = {0};                      \
+    for (size_t t = 0; t < nthreads; ++t)                               \
+    {                                                                   \
+      jobs[t].begin = total / nthreads * t;                             \
+      jobs[t].end = total / nthreads * (t + 1);                         \
+      if (t + 1 == nthreads) jobs[t].end = total;                       \
+    }                                                                   \
+    for (size_t t = 1; t < nthreads; ++t)                               \
+    {                                                                   \
+      started[t] = pthread_create(&threads[t], NULL,                    \
+                                  prefix##_set_merge_worker,            \
+                                  &jobs[t]) == 0;                       \
+      if (!started[t]) prefix##_set_merge_worker(&jobs[t]);             \
+    }                                                                   \
+    prefix##_set_merge_worker(&jobs[0]);                                \
+    for (size_t t = 1; t < nthreads; ++t)                               \
+      if (started[t]) pthread_join(threads[t], NULL);                   \
+    for (size_t t = 0; t < nthreads; ++t)                               \
+      if (jobs[t].error) return jobs[t].error;                          \
+    return HASHSET_OK;                                                  \
+  }                                                                     \
+                                                                        \
+  static inline int prefix##_set_merge_many(prefix##_set *dst,          \
+                                            prefix##_set **srcs,        \
+                                            size_t n,                   \
+                                            size_t nthreads)            \
+  {                                                                     \
+    if (!dst || (n && !srcs)) return HASHSET_ERROR_SET_NULL;            \
+    if (nthreads > HASHSET_MERGE_MAX_THREADS)                           \
+      nthreads = HASHSET_MERGE_MAX_THREADS;                             \
+                                                                        \
+    size_t total = dst->size, slots = 0;                                \
+    prefix##_set_resize_wait(dst);                                      \
+    for (size_t j = 0; j < n; ++j)                                      \
+    {                                                                   \
+      prefix##_set_resize_wait(srcs[j]);                                \
+      total += srcs[j]->size;                                           \
+      slots += srcs[j]->capacity;                                       \
+    }                                                                   \
+    int err = prefix##_set_reserve(dst, total);                         \
+    if (err != HASHSET_OK) return err;                                  \
+    /* The serial merge records its inserts in the trace of dst */      \
+    if (nthreads < 2 || dst->capacity < nthreads                        \
+        || HASHSET_TRACING(dst))                                        \
+      return prefix##_set_merge_serial(dst, srcs, n);                   \
+                                                                        \
+    prefix##_set_merge_job jobs[HASHSET_MERGE_MAX_THREADS];             \
+    hashset_hash_t *hashes = HASHSET_CALLOC(slots ? slots : 1,          \
+                                            sizeof(hashset_hash_t));    \
+    if (!hashes) return prefix##_set_merge_serial(dst, srcs, n);        \
+    for (size_t t = 0; t < nthreads; ++t)                               \
+      jobs[t] = (prefix##_set_merge_job) {                              \
+        .dst = dst, .srcs = srcs, .n = n, .hashes = hashes,             \
+        .jobs = jobs, .id = t, .nthreads = nthreads,                    \
+      };                                                                \
+                                                                        \
+    /* Hash every source key once, then let each thread insert the */   \
+    /* keys whose home slot is in its own part of the table */          \
+    err = prefix##_set_merge_run(jobs, nthreads, slots);                \
+    for (size_t t = 0; t < nthreads; ++t)                               \
+      jobs[t].phase = 1;                                                \
+    if (err == HASHSET_OK)                                              \
+      err = prefix##_set_merge_run(jobs, nthreads, dst->capacity);      \
+                                                                        \
+    for (size_t t = 0; t < nthreads; ++t)                               \
+    {                                                                   \
+      dst->size += jobs[t].added;                                       \
+      size_t flat = 0, j = 0;                                           \
+      for (size_t k = 0; k < jobs[t].spill_len; ++k)                    \
+      {                                                                 \
+        /* Spills are in source order, walk the sources once */         \
+        while (jobs[t].spill[k] >= flat + srcs[j]->capacity)            \
+          flat += srcs[j++]->capacity;                                  \
+        prefix##_##type##_size_pair *e =                                \
+          &srcs[j]->data[jobs[t].spill[k] - flat];                      \
+        prefix##_set_insert_hashed(dst, HASHSET_KEY_##pass(e->val),     \
+                                   e->size, hashes[jobs[t].spill[k]]);  \
+      }                                                                 \
+      if (jobs[t].spill) HASHSET_FREE(jobs[t].spill);                   \
+      if (jobs[t].keys) HASHSET_FREE(jobs[t].keys);                     \
+    }                                                                   \
+    HASHSET_FREE(hashes);                                               \
+                                                                        \
+    /* Inserting twice is harmless, finish serially on errors */        \
+    if (err != HASHSET_OK)                                              \
+      return prefix##_set_merge_serial(dst, srcs, n);                   \
+    return HASHSET_OK;                                                  \
+  }
+
+#else
+
+#define HASHSET_DECLARE_MERGE(prefix, type, pass, hash_fn, eq_fn)       \
+  static inline int prefix##_set_merge_many(prefix##_set *dst,          \
+                                            prefix##_set **srcs,        \
+                                            size_t n,                   \
+                                            size_t nthreads)            \
+  {                                                                     \
+    (void) nthreads;                                                    \
+    if (!dst || (n && !srcs)) return HASHSET_ERROR_SET_NULL;            \
+                                                                        \
+    size_t total = dst->size;                                           \
+    for (size_t j = 0; j < n; ++j)                                      \
+      total += srcs[j]->size;                                           \
+    int err = prefix##_set_reserve(dst, total);                         \
+    if (err != HASHSET_OK) return err;                                  \
+    return prefix##_set_merge_serial(dst, srcs, n);                     \
+  }
+
+#endif // HASHSET_THREADS
+
+#define HASHSET_DECLARE_DUMP_LAYOUT(prefix, type, pass, hash_fn)        \
+  static inline void prefix##_set_dump_layout(prefix##_set *set,        \
+                                              FILE *out)                \
+  {                                                                     \
+    if (!set || !out) return;                                           \
+                                                                        \
+    size_t cap = set->capacity, mask = cap - 1;                         \
+    size_t regions = cap < HASHSET_DUMP_REGIONS                         \
+      ? cap : HASHSET_DUMP_REGIONS;                                     \
+    size_t slots = cap / regions;                                       \
+    size_t runs[HASHSET_DUMP_BUCKETS] = {0};                            \
+    size_t moved[HASHSET_DUMP_BUCKETS] = {0};                           \
+    size_t used[HASHSET_DUMP_REGIONS] = {0};                            \
+    size_t deleted[HASHSET_DUMP_REGIONS] = {0};                         \
+    size_t tombstones = 0, clusters = 0, in_clusters = 0;               \
+    size_t longest = 0, longest_at = 0, total_moved = 0;                \
+                                                                        \
+    /* Start after an empty slot, so no cluster wraps around */         \
+    size_t start = 0;                                                   \
+    while (start < cap && set->state[start] != 0) start++;              \
+    size_t run = 0;                                                     \
+    for (size_t n = 1; n <= cap; ++n)                                   \
+    {                                                                   \
+      size_t idx = (start + n) & mask;                                  \
+      if (set->state[idx] != 0)                                         \
+      {                                                                 \
+        run++;                                                          \
+        if (set->state[idx] == 2)                                       \
+        {                                                               \
+          deleted[idx / slots]++;                                       \
+          tombstones++;                                                 \
+        }                                                               \
+        else                                                            \
+        {                                                               \
+          prefix##_##type##_size_pair *e = &set->data[idx];             \
+          size_t home = hash_fn(HASHSET_KEY_##pass(e->val),             \
+                                e->size) & mask;                        \
+          size_t d = (idx - home) & mask;                               \
+          moved[hashset_dump_bucket(d)]++;                              \
+          total_moved += d;                                             \
+          used[idx / slots]++;                                          \
+        }                                                               \
+      }                                                                 \
+      if (run && (set->state[idx] == 0 || n == cap))                    \
+      {                                                                 \
+        runs[hashset_dump_bucket(run)]++;                               \
+        clusters++;                                                     \
+        in_clusters += run;                                             \
+        if (run > longest)                                              \
+        {                                                               \
+          longest = run;                                                \
+          longest_at = (idx - run + (set->state[idx] != 0)) & mask;     \
+        }                                                               \
+        run = 0;                                                        \
+      }                                                                 \
+    }                                                                   \
+                                                                        \
+    size_t size = in_clusters - tombstones;                             \
+    fprintf(out, "capacity %zu, used %zu (%.2f), tombstones %zu "       \
+            "(%.2f)\n", cap, size, (double) size / cap, tombstones,     \
+            (double) tombstones / cap);                                 \
+    fprintf(out, "clusters %zu, mean length %.2f, "                     \
+            "longest %zu at %zu\n", clusters,                           \
+            clusters ? (double) in_clusters / clusters : 0.0,           \
+            longest, longest_at);                                       \
+    fprintf(out, "mean displacement %.2f\n",                            \
+            size ? (double) total_moved / size : 0.0);                  \
+    hashset_dump_histogram(out, "cluster lengths:", runs);              \
+    hashset_dump_histogram(out, "displacements from the home slot:",    \
+                           moved);                                      \
+    hashset_dump_heatmap(out, "used slots by region:", used,            \
+                         regions, slots);                               \
+    hashset_dump_heatmap(out, "tombstones by region:", deleted,         \
+                         regions, slots);                               \
+  }
+
+#define HASHSET_DECLARE_SET(prefix, type, pass, hash_fn, eq_fn)         \
+  typedef struct {                                                      \
+    type val;                                                           \
+    unsigned int size;                                                  \
+  } prefix##_##type##_size_pair;                                        \
+                                                                        \
+  typedef HASHSET_KEY_T_##pass(type) prefix##_set_key;                  \
+                                                                        \
+  typedef struct {                                                      \
+    prefix##_##type##_size_pair *data;                                  \
+    uint8_t *state; /* 0=empty,1=used,2=deleted */                      \
+    size_t size;                                                        \
+    size_t capacity;                                                    \
+    size_t cursor; /* where prefix_set_pop looks first */               \
+    hashset_pool *pool; /* where tables come from, if not NULL */       \
+    HASHSET_BACKGROUND_FIELDS(prefix, type)                             \
+    HASHSET_TRACE_FIELDS                                                \
+    HASHSET_ADAPTIVE_FIELDS                                             \
+  } prefix##_set;                                                       \
+                                                                        \
+  static inline hashset_hash_t prefix##_set_hash(prefix##_set_key key,  \
+                                                 unsigned int key_len)  \
+  {                                                                     \
+    return hash_fn(key, key_len);                                       \
+  }                                                                     \
+                                                                        \
+  static inline int prefix##_set_resize(prefix##_set *set,              \
+                                        size_t newcap);                 \
+  static inline bool prefix##_set_insert_hashed(prefix##_set *set,      \
+                                                prefix##_set_key key,   \
+                                                unsigned int key_len,   \
+                                                hashset_hash_t hash);   \
+  static inline bool prefix##_set_remove_hashed(prefix##_set *set,      \
+                                                prefix##_set_key key,   \
+                                                unsigned int key_len,   \
+                                                hashset_hash_t hash);   \
+  static inline bool prefix##_set_insert_table(prefix##_set *set,       \
+                                               prefix##_set_key key,    \
+                                               unsigned int key_len,    \
+                                               hashset_hash_t hash);    \
+  static inline bool prefix##_set_remove_table(prefix##_set *set,       \
+                                               prefix##_set_key key,    \
+                                               unsigned int key_len,    \
+                                               hashset_hash_t hash);    \
+                                                                        \
+  static inline int                                                     \
+  prefix##_set_table_new(prefix##_set *set,                             \
+                         size_t capacity,                               \
+                         prefix##_##type##_size_pair **data,            \
+                         uint8_t **state)                               \
+  {                                                                     \
+    /* Only the state needs to be cleared */                            \
+    *data = hashset_pool_alloc(set->pool, capacity, sizeof(**data),     \
+                               false);                                  \
+    if (!*data) return HASHSET_ERROR_ALLOCATION;                        \
+    *state = hashset_pool_alloc(set->pool, capacity, 1, true);          \
+    if (!*state)                                                        \
+    {                                                                   \
+      hashset_pool_free(set->pool, *data, capacity * sizeof(**data));   \
+      return HASHSET_ERROR_ALLOCATION;                                  \
+    }                                                                   \
+    return HASHSET_OK;                                                  \
+  }                                                                     \
+                                                                        \
+  static inline void                                                    \
+  prefix##_set_table_free(prefix##_set *set,                            \
+                          size_t capacity,                              \
+                          prefix##_##type##_size_pair *data,            \
+                          uint8_t *state)                               \
+  {                                                                     \
+    hashset_pool_free(set->pool, data, capacity * sizeof(*data));       \
+    hashset_pool_free(set->pool, state, capacity);                      \
+  }                                                                     \
+                                                                        \
+  static inline int prefix##_set_init_pool(prefix##_set *set,           \
+                                           hashset_pool *pool)          \
+  {                                                                     \
+    if (!set) return HASHSET_ERROR_SET_NULL;                            \
+                                                                        \
+    *set = (prefix##_set) {0};                                          \
+    set->size = 0;                                                      \
+    set->capacity = HASHSET_INITIAL_CAPACITY;                           \
+    set->pool = pool;                                                   \
+    return prefix##_set_table_new(set, set->capacity,                   \
+                                  &set->data, &set->state);             \
+  }                                                                     \
+                                                                        \
+  static inline int prefix##_set_init(prefix##_set *set)                \
+  {                                                                     \
+    return prefix##_set_init_pool(set, NULL);                           \
+  }                                                                     \
+                                                                        \
+  static inline size_t                                                  \
+  prefix##_set_find_slot_hashed(prefix##_set *set,                      \
+                                prefix##_set_key key,                   \
+                                unsigned int key_len,                   \
+                                hashset_hash_t hash)                    \
+  {                                                                     \
+    size_t mask = set->capacity - 1;                                    \
+    size_t idx = hash & mask;                                           \
+    size_t deleted = set->capacity; /* first tombstone on the way */    \
+    for (size_t n = 0; n < set->capacity; ++n)                          \
+    {                                                                   \
+      if (set->state[idx] == 0)                                         \
+      {                                                                 \
+        HASHSET_ADAPTIVE_COUNT(set, n + 1, false);                      \
+        return deleted < set->capacity ? deleted : idx;                 \
+      }                                                                 \
+      if (set->state[idx] == 2)                                         \
+      {                                                                 \
+        if (deleted == set->capacity) deleted = idx;                    \
+      }                                                                 \
+      else if (HASHSET_SIZE_EQ(set->data[idx].size, key_len)            \
+               && eq_fn(HASHSET_KEY_##pass(set->data[idx].val),         \
+                        set->data[idx].size, key, key_len))             \
+      {                                                                 \
+        HASHSET_ADAPTIVE_COUNT(set, n + 1, true);                       \
+        return idx;                                                     \
+      }                                                                 \
+      idx = (idx + 1) & mask;                                           \
+    }                                                                   \
+    HASHSET_ADAPTIVE_COUNT(set, set->capacity, false);                  \
+    return deleted; /* full */                                          \
+  }                                                                     \
+                                                                        \
+  static inline size_t prefix##_set_find_slot(prefix##_set *set,        \
+                                              prefix##_set_key key,     \
+                                              unsigned int key_len)     \
+  {                                                                     \
+    if (!set) return HASHSET_ERROR_SET_NULL;                            \
+    return prefix##_set_find_slot_hashed(set, key, key_len,             \
+                                         hash_fn(key, key_len));        \
+  }                                                                     \
+                                                                        \
+  static inline void prefix##_set_erase_slot(prefix##_set *set,         \
+                                             size_t idx)                \
+  {                                                                     \
+    /* Backward shift deletion: move back the entries after [idx] */    \
+    /* whose probe sequence crosses it, so no tombstone is needed */    \
+    size_t mask = set->capacity - 1;                                    \
+    size_t j = idx;                                                     \
+    for (size_t n = 1; n < set->capacity; ++n)                          \
+    {                                                                   \
+      j = (j + 1) & mask;                                               \
+      if (set->state[j] == 0) break;                                    \
+      if (set->state[j] != 1) continue;                                 \
+      size_t home = hash_fn(HASHSET_KEY_##pass(set->data[j].val),       \
+                            set->data[j].size) & mask;                  \
+      if (((j - home) & mask) < ((j - idx) & mask)) continue;           \
+      set->data[idx] = set->data[j];                                    \
+      set->state[idx] = 1;                                              \
+      idx = j;                                                          \
+    }                                                                   \
+    set->state[idx] = 0;                                                \
+  }                                                                     \
+                                                                        \
+  static inline void                                                    \
+  prefix##_set_place(prefix##_##type##_size_pair *data,                 \
+                     uint8_t *state,                                    \
+                     size_t capacity,                                   \
+                     prefix##_##type##_size_pair val)                   \
+  {                                                                     \
+    /* [val] is known to be absent, take the first free slot */         \
+    size_t mask = capacity - 1;                                         \
+    size_t idx = hash_fn(HASHSET_KEY_##pass(val.val), val.size) & mask; \
+    while (state[idx] == 1)                                             \
+      idx = (idx + 1) & mask;                                           \
+    data[idx] = val;                                                    \
+    state[idx] = 1;                                                     \
+  }                                                                     \
+                                                                        \
+  static inline void                                                    \
+  prefix##_set_migrate(prefix##_##type##_size_pair *data,               \
+                       uint8_t *state,                                  \
+                       size_t capacity,                                 \
+                       const prefix##_##type##_size_pair *old_data,     \
+                       const uint8_t *old_state,                        \
+                       size_t old_cap)                                  \
+  {                                                                     \
+    /* Start at a slot without a key, empty or a tombstone, so that */  \
+    /* no run of keys wraps around the scan. Entries then leave in */   \
+    /* home order, and when the table doubles slot i lands near i */    \
+    /* or i + old_cap: the writes are two almost sequential streams */  \
+    /* instead of random ones. */                                       \
+    size_t start = 0;                                                   \
+    while (start < old_cap && old_state[start] == 1)                    \
+      start++;                                                          \
+                                                                        \
+    for (size_t n = 0; n < old_cap; n++)                                \
+    {                                                                   \
+      size_t i = (start + n) & (old_cap - 1);                           \
+      if (old_state[i] != 1) continue;                                  \
+      prefix##_set_place(data, state, capacity, old_data[i]);           \
+    }                                                                   \
+  }                                                                     \
+                                                                        \
+  HASHSET_DECLARE_BACKGROUND_RESIZE(prefix, type, pass, hash_fn, eq_fn) \
+                                                                        \
+  static inline void prefix##_set_destroy(prefix##_set *set)            \
+  {                                                                     \
+    if (!set) return;                                                   \
+                                                                        \
+    prefix##_set_resize_wait(set);                                      \
+    prefix##_set_table_free(set, set->capacity, set->data, set->state); \
+    set->data = NULL; set->state = NULL;                                \
+    set->size = set->capacity = 0;                                      \
+                                                                        \
+    return;                                                             \
+  }                                                                     \
+                                                                        \
+  static inline int prefix##_set_resize(prefix##_set *set,              \
+                                        size_t newcap)                  \
+  {                                                                     \
+    if (!set) return HASHSET_ERROR_SET_NULL;                            \
+    /* The probes mask the hash with capacity - 1 */                    \
+    if (!newcap || (newcap & (newcap - 1)) || newcap < set->size)       \
+      return HASHSET_ERROR_FULL;                                        \
+    prefix##_set_resize_wait(set);                                      \
+                                                                        \
+    prefix##_##type##_size_pair *data;                                  \
+    uint8_t *state;                                                     \
+    int err = prefix##_set_table_new(set, newcap, &data, &state);       \
+    if (err != HASHSET_OK) return err;                                  \
+                                                                        \
+    prefix##_set_migrate(data, state, newcap,                           \
+                         set->data, set->state, set->capacity);         \
+                                                                        \
+    prefix##_set_table_free(set, set->capacity, set->data, set->state); \
+    set->data = data;                                                   \
+    set->state = state;                                                 \
+    set->capacity = newcap;                                             \
+    HASHSET_ADAPTIVE_RESET(set);                                        \
+    return HASHSET_OK;                                                  \
+  }                                                                     \
+                                                                        \
+  static inline int prefix##_set_reserve(prefix##_set *set, size_t n)   \
+  {                                                                     \
+    if (!set) return HASHSET_ERROR_SET_NULL;                            \
+    prefix##_set_resize_wait(set);                                      \
+                                                                        \
+    size_t newcap = set->capacity;                                      \
+    while ((double)n / newcap > HASHSET_MAX_LOAD_FACTOR)                \
+      newcap *= 2;                                                      \
+    if (newcap == set->capacity) return HASHSET_OK;                     \
+    return prefix##_set_resize(set, newcap);                            \
+  }                                                                     \
+                                                                        \
+  static inline void prefix##_set_shrink(prefix##_set *set)             \
+  {                                                                     \
+    /* Halve as many times as the removals allow, at once. If the */    \
+    /* allocation fails the set keeps its table, which still works */   \
+    size_t newcap = set->capacity;                                      \
+    while (HASHSET_UNDER_LOAD(set->size, newcap))                       \
+      newcap /= 2;                                                      \
+    if (newcap != set->capacity) prefix##_set_resize(set, newcap);      \
+  }                                                                     \
+                                                                        \
+  /* Inserts in the table of [set], past a background resize */         \
+  static inline bool prefix##_set_insert_table(prefix##_set *set,       \
+                                               prefix##_set_key key,    \
+                                               unsigned int key_len,    \
+                                               hashset_hash_t hash)     \
+  {                                                                     \
+    if (HASHSET_OVER_LOAD(set, set->size, set->capacity))               \
+    {                                                                   \
+      prefix##_set_grow(set);                                           \
+      if (prefix##_set_bg_active(set))                                  \
+        return prefix##_set_bg_insert(set, key, key_len, hash);         \
+    }                                                                   \
+                                                                        \
+    size_t idx =                                                        \
+      prefix##_set_find_slot_hashed(set, key, key_len, hash);           \
+    if (idx >= set->capacity) return false;                             \
+                                                                        \
+    if (set->state[idx] == 1) return false; /* already exists */        \
+    set->data[idx] =                                                    \
+      (prefix##_##type##_size_pair) {.val = HASHSET_VAL_##pass(key),    \
+                                     .size = key_len};                  \
+    set->state[idx] = 1;                                                \
+    set->size++;                                                        \
+                                                                        \
+    return true;                                                        \
+  }                                                                     \
+                                                                        \
+  static inline bool prefix##_set_insert_hashed(prefix##_set *set,      \
+                                                prefix##_set_key key,   \
+                                                unsigned int key_len,   \
+                                                hashset_hash_t hash)    \
+  {                                                                     \
+    if (prefix##_set_bg_active(set))                                    \
+      return prefix##_set_bg_insert(set, key, key_len, hash);           \
+    return prefix##_set_insert_table(set, key, key_len, hash);          \
+  }                                                                     \
+                                                                        \
+  static inline bool prefix##_set_insert(prefix##_set *set,             \
+                                         prefix##_set_key key,          \
+                                         unsigned int key_len)          \
+  {                                                                     \
+    if (set == NULL) return false;                                      \
+    hashset_hash_t hash = hash_fn(key, key_len);                        \
+    bool ret = prefix##_set_insert_hashed(set, key, key_len, hash);     \
+    HASHSET_TRACE_CALL(set, HASHSET_TRACE_INSERT,                       \
+                       HASHSET_BYTES_##pass(key), sizeof(type),         \
+                       key_len, hash, ret);                             \
+    return ret;                                                         \
+  }                                                                     \
+                                                                        \
+  static inline bool prefix##_set_contains_hashed(prefix##_set *set,    \
+                                                  prefix##_set_key key, \
+                                                  unsigned int key_len, \
+                                                  hashset_hash_t hash)  \
+  {                                                                     \
+    if (prefix##_set_bg_active(set))                                    \
+      return prefix##_set_bg_contains(set, key, key_len, hash);         \
+    size_t idx =                                                        \
+      prefix##_set_find_slot_hashed(set, key, key_len, hash);           \
+    if (idx >= set->capacity) return false;                             \
+    return set->state[idx] == 1;                                        \
+  }                                                                     \
+                                                                        \
+  static inline bool prefix##_set_contains(prefix##_set *set,           \
+                                           prefix##_set_key key,        \
+                                           unsigned int key_len)        \
+  {                                                                     \
+    if (!set) return false;                                             \
+    hashset_hash_t hash = hash_fn(key, key_len);                        \
+    bool ret = prefix##_set_contains_hashed(set, key, key_len, hash);   \
+    HASHSET_TRACE_CALL(set, HASHSET_TRACE_CONTAINS,                     \
+                       HASHSET_BYTES_##pass(key), sizeof(type),         \
+                       key_len, hash, ret);                             \
+    return ret;                                                         \
+  }                                                                     \
+                                                                        \
+  static inline bool prefix##_set_insert_unique(prefix##_set *set,      \
+                                                prefix##_set_key key,   \
+                                                unsigned int key_len)   \
+  {                                                                     \
+    if (set == NULL) return false;                                      \
+    assert(!prefix##_set_contains_hashed(set, key, key_len,             \
+                                         hash_fn(key, key_len)));       \
+    HASHSET_TRACE_CALL(set, HASHSET_TRACE_INSERT,                       \
+                       HASHSET_BYTES_##pass(key), sizeof(type),         \
+                       key_len, hash_fn(key, key_len), true);           \
+    if (prefix##_set_bg_active(set))                                    \
+      return prefix##_set_bg_insert(set, key, key_len,                  \
+                                    hash_fn(key, key_len));             \
+    if (HASHSET_OVER_LOAD(set, set->size, set->capacity))               \
+    {                                                                   \
+      prefix##_set_grow(set);                                           \
+      if (prefix##_set_bg_active(set))                                  \
+        return prefix##_set_bg_insert(set, key, key_len,                \
+                                    hash_fn(key, key_len));             \
+    }                                                                   \
+                                                                        \
+    prefix##_set_place(set->data, set->state, set->capacity,            \
+      (prefix##_##type##_size_pair) {.val = HASHSET_VAL_##pass(key),    \
+                                     .size = key_len});                 \
+    set->size++;                                                        \
+    return true;                                                        \
+  }                                                                     \
+                                                                        \
+  static inline int                                                     \
+  prefix##_set_insert_unique_batch(prefix##_set *set,                   \
+                                   const type *keys,                    \
+                                   const unsigned int *key_lens,        \
+                                   size_t n)                            \
+  {                                                                     \
+    if (!set) return HASHSET_ERROR_SET_NULL;                            \
+    int err = prefix##_set_reserve(set, set->size + n);                 \
+    if (err != HASHSET_OK) return err;                                  \
+                                                                        \
+    for (size_t i = 0; i < n; ++i)                                      \
+    {                                                                   \
+      unsigned int key_len = key_lens ? key_lens[i] : 0;                \
+      assert(!prefix##_set_contains_hashed(set,                         \
+               HASHSET_KEY_##pass(keys[i]), key_len,                    \
+               hash_fn(HASHSET_KEY_##pass(keys[i]), key_len)));         \
+      HASHSET_TRACE_CALL(set, HASHSET_TRACE_INSERT, &keys[i],           \
+                         sizeof(type), key_len,                         \
+                         hash_fn(HASHSET_KEY_##pass(keys[i]), key_len), \
+                         true);                                         \
+      prefix##_##type##_size_pair val = {.val = keys[i],                \
+                                         .size = key_len};              \
+      prefix##_set_place(set->data, set->state, set->capacity, val);    \
+      set->size++;                                                      \
+    }                                                                   \
+    return HASHSET_OK;                                                  \
+  }                                                                     \
+                                                                        \
+  /* Removes from the table of [set], past a background resize */       \
+  static inline bool prefix##_set_remove_table(prefix##_set *set,       \
+                                               prefix##_set_key key,    \
+                                               unsigned int key_len,    \
+                                               hashset_hash_t hash)     \
+  {                                                                     \
+    size_t idx =                                                        \
+      prefix##_set_find_slot_hashed(set, key, key_len, hash);           \
+    if (idx >= set->capacity || set->state[idx] != 1) return false;     \
+    set->state[idx] = 2; /* mark deleted */                             \
+    set->size--;                                                        \
+    prefix##_set_shrink(set);                                           \
+    return true;                                                        \
+  }                                                                     \
+                                                                        \
+  static inline bool prefix##_set_remove_hashed(prefix##_set *set,      \
+                                                prefix##_set_key key,   \
+                                                unsigned int key_len,   \
+                                                hashset_hash_t hash)    \
+  {                                                                     \
+    if (prefix##_set_bg_active(set))                                    \
+      return prefix##_set_bg_remove(set, key, key_len, hash);           \
+    return prefix##_set_remove_table(set, key, key_len, hash);          \
+  }                                                                     \
+                                                                        \
+  static inline bool prefix##_set_remove(prefix##_set *set,             \
+                                         prefix##_set_key key,          \
+                                         unsigned int key_len)          \
+  {                                                                     \
+    if (!set) return false;                                             \
+    hashset_hash_t hash = hash_fn(key, key_len);                        \
+    bool ret = prefix##_set_remove_hashed(set, key, key_len, hash);     \
+    HASHSET_TRACE_CALL(set, HASHSET_TRACE_REMOVE,                       \
+                       HASHSET_BYTES_##pass(key), sizeof(type),         \
+                       key_len, hash, ret);                             \
+    return ret;                                                         \
+  }                                                                     \
+                                                                        \
+  static inline size_t                                                  \
+  prefix##_set_remove_batch(prefix##_set *set,                          \
+                            const type *keys,                           \
+                            const unsigned int *key_lens,               \
+                            size_t n)                                   \
+  {                                                                     \
+    if (!set) return 0;                                                 \
+    prefix##_set_resize_wait(set);                                      \
+                                                                        \
+    size_t removed = 0;                                                 \
+    for (size_t i = 0; i < n; ++i)                                      \
+    {                                                                   \
+      unsigned int key_len = key_lens ? key_lens[i] : 0;                \
+      size_t idx = prefix##_set_find_slot(set,                          \
+                                          HASHSET_KEY_##pass(keys[i]),  \
+                                          key_len);                     \
+      bool found = idx < set->capacity && set->state[idx] == 1;         \
+      HASHSET_TRACE_CALL(set, HASHSET_TRACE_REMOVE, &keys[i],           \
+                         sizeof(type), key_len,                         \
+                         hash_fn(HASHSET_KEY_##pass(keys[i]), key_len), \
+                         found);                                        \
+      if (!found) continue;                                             \
+      prefix##_set_erase_slot(set, idx);                                \
+      set->size--;                                                      \
+      removed++;                                                        \
+    }                                                                   \
+    prefix##_set_shrink(set);                                           \
+    return removed;                                                     \
+  }                                                                     \
+                                                                        \
+  static inline size_t                                                  \
+  prefix##_set_erase_if(prefix##_set *set,                              \
+                        bool (*pred)(prefix##_set_key key,              \
+                                     unsigned int key_len,              \
+                                     void *ctx),                        \
+                        void *ctx)                                      \
+  {                                                                     \
+    if (!set || !pred) return 0;                                        \
+    prefix##_set_resize_wait(set);                                      \
+                                                                        \
+    /* Scan from an empty slot: entries shifted back into the */        \
+    /* current slot then always come from the part not seen yet */      \
+    size_t mask = set->capacity - 1;                                    \
+    size_t start = 0;                                                   \
+    while (start < set->capacity && set->state[start] != 0)             \
+      start++;                                                          \
+                                                                        \
+    size_t removed = 0;                                                 \
+    for (size_t n = 0; n < set->capacity;)                              \
+    {                                                                   \
+      size_t idx = (start + n) & mask;                                  \
+      if (set->state[idx] == 2                                          \
+          || (set->state[idx] == 1                                      \
+              && pred(HASHSET_KEY_##pass(set->data[idx].val),           \
+                      set->data[idx].size, ctx)))                       \
+      {                                                                 \
+        if (set->state[idx] == 1)                                       \
+        {                                                               \
+          HASHSET_TRACE_CALL(set, HASHSET_TRACE_REMOVE,                 \
+                             &set->data[idx].val, sizeof(type),         \
+                             set->data[idx].size,                       \
+                             hash_fn(HASHSET_KEY_##pass(                \
+                                       set->data[idx].val),             \
+                                     set->data[idx].size),              \
+                             true);                                     \
+          set->size--;                                                  \
+          removed++;                                                    \
+        }                                                               \
+        prefix##_set_erase_slot(set, idx);                              \
+        if (set->state[idx] == 1) continue; /* look at the new entry */ \
+      }                                                                 \
+      n++;                                                              \
+    }                                                                   \
+    prefix##_set_shrink(set);                                           \
+    return removed;                                                     \
+  }                                                                     \
+                                                                        \
+  static inline size_t prefix##_set_next_used(prefix##_set *set,        \
+                                              size_t idx)               \
+  {                                                                     \
+    /* Check eight aligned slots per load, also after wrapping */       \
+    /* around, used slots have the low bit set */                       \
+    size_t mask = set->capacity - 1;                                    \
+    while (set->state[idx] != 1)                                        \
+    {                                                                   \
+      if (idx % 8 == 0 && idx + 8 <= set->capacity)                     \
+      {                                                                 \
+        uint64_t word;                                                  \
+        memcpy(&word, set->state + idx, sizeof(word));                  \
+        if (!(word & 0x0101010101010101ULL))                            \
+        {                                                               \
+          idx = (idx + 8) & mask;                                       \
+          continue;                                                     \
+        }                                                               \
+      }                                                                 \
+      idx = (idx + 1) & mask;                                           \
+    }                                                                   \
+    return idx;                                                         \
+  }                                                                     \
+                                                                        \
+  static inline bool prefix##_set_sample(prefix##_set *set,             \
+                                         uint64_t *rng,                 \
+                                         type *key,                     \
+                                         unsigned int *key_len)         \
+  {                                                                     \
+    if (!set || !rng) return false;                                     \
+    prefix##_set_resize_wait(set);                                      \
+    if (set->size == 0) return false;                                   \
+                                                                        \
+    size_t mask = set->capacity - 1;                                    \
+    size_t idx = hashset_rand(rng) & mask;                              \
+    for (int tries = 1;                                                 \
+         set->state[idx] != 1 && tries < HASHSET_SAMPLE_TRIES; ++tries) \
+      idx = hashset_rand(rng) & mask;                                   \
+    if (set->state[idx] != 1)                                           \
+      idx = prefix##_set_next_used(set, idx);                           \
+                                                                        \
+    if (key) *key = set->data[idx].val;                                 \
+    if (key_len) *key_len = set->data[idx].size;                        \
+    return true;                                                        \
+  }                                                                     \
+                                                                        \
+  static inline bool prefix##_set_pop(prefix##_set *set,                \
+                                      type *key,                        \
+                                      unsigned int *key_len)            \
+  {                                                                     \
+    if (!set) return false;                                             \
+    prefix##_set_resize_wait(set);                                      \
+    if (set->size == 0) return false;                                   \
+                                                                        \
+    size_t idx = set->cursor & (set->capacity - 1);                     \
+    idx = prefix##_set_next_used(set, idx);                             \
+    if (key) *key = set->data[idx].val;                                 \
+    if (key_len) *key_len = set->data[idx].size;                        \
+    HASHSET_TRACE_CALL(set, HASHSET_TRACE_REMOVE, &set->data[idx].val,  \
+                       sizeof(type), set->data[idx].size,               \
+                       hash_fn(HASHSET_KEY_##pass(set->data[idx].val),  \
+                               set->data[idx].size),                    \
+                       true);                                           \
+    prefix##_set_erase_slot(set, idx);                                  \
+    set->size--;                                                        \
+    set->cursor = idx;                                                  \
+    prefix##_set_shrink(set);                                           \
+    return true;                                                        \
+  }                                                                     \
+                                                                        \
+  static inline int prefix##_set_merge_serial(prefix##_set *dst,        \
+                                              prefix##_set **srcs,      \
+                                              size_t n)                 \
+  {                                                                     \
+    for (size_t j = 0; j < n; ++j)                                      \
+      for (size_t i = 0; i < srcs[j]->capacity; ++i)                    \
+      {                                                                 \
+        if (srcs[j]->state[i] != 1) continue;                           \
+        prefix##_##type##_size_pair *e = &srcs[j]->data[i];             \
+        if (!prefix##_set_insert(dst, HASHSET_KEY_##pass(e->val),       \
+                                 e->size)                               \
+            && !prefix##_set_contains(dst, HASHSET_KEY_##pass(e->val),  \
+                                      e->size))                         \
+          return HASHSET_ERROR_ALLOCATION;                              \
+      }                                                                 \
+    return HASHSET_OK;                                                  \
+  }                                                                     \
+                                                                        \
+  HASHSET_DECLARE_MERGE(prefix, type, pass, hash_fn, eq_fn)             \
+  HASHSET_DECLARE_DUMP_LAYOUT(prefix, type, pass, hash_fn)              \
+  HASHSET_DECLARE_TRACE(prefix)
+
+#define HASHSET_DECLARE(prefix, type, hash_fn, eq_fn)                   \
+  HASHSET_DECLARE_SET(prefix, type, VALUE, hash_fn, eq_fn)
+
+#define HASHSET_DECLARE_REF(prefix, type, hash_fn, eq_fn)               \
+  HASHSET_DECLARE_SET(prefix, type, REF, hash_fn, eq_fn)
+
+// sizeof(type) is a constant, so the hash loop is unrolled and
+// memcmp becomes a few wide compares
+#define HASHSET_DECLARE_POD(prefix, type)                               \
+  static inline hashset_hash_t prefix##_pod_hash(const type *key,       \
+                                                 unsigned int key_len)  \
+  {                                                                     \
+    (void) key_len;                                                     \
+    return (hashset_hash_t) hashset_hash_bytes(key, sizeof(type));      \
+  }                                                                     \
+                                                                        \
+  static inline bool prefix##_pod_eq(const type *a, unsigned int a_len, \
+                                     const type *b, unsigned int b_len) \
+  {                                                                     \
+    (void) a_len;                                                       \
+    (void) b_len;                                                       \
+    return memcmp(a, b, sizeof(type)) == 0;                             \
+  }                                                                     \
+                                                                        \
+  HASHSET_DECLARE_REF(prefix, type, prefix##_pod_hash, prefix##_pod_eq)
+
+#define HASHSET_DECLARE_U128(prefix)                                    \
+  typedef struct {                                                      \
+    hashset_u128 *keys;                                                 \
+    uint8_t *ctrl; /* HASHSET_CTRL_EMPTY, _DELETED or a fingerprint */  \
+    size_t size;                                                        \
+    size_t deleted;                                                     \
+    size_t capacity; /* a power of two, at least HASHSET_GROUP */       \
+  } prefix##_set;                                                       \
+                                                                        \
+  static inline int prefix##_set_table_new(size_t capacity,             \
+                                           hashset_u128 **keys,         \
+                                           uint8_t **ctrl)              \
+  {                                                                     \
+    *keys = HASHSET_CALLOC(capacity, sizeof(hashset_u128));             \
+    if (!*keys) return HASHSET_ERROR_ALLOCATION;                        \
+    *ctrl = HASHSET_CALLOC(capacity, sizeof(uint8_t));                  \
+    if (!*ctrl)                                                         \
+    {                                                                   \
+      HASHSET_FREE(*keys);                                              \
+      return HASHSET_ERROR_ALLOCATION;                                  \
+    }                                                                   \
+    memset(*ctrl, HASHSET_CTRL_EMPTY, capacity);                        \
+    return HASHSET_OK;                                                  \
+  }                                                                     \
+                                                                        \
+  static inline int prefix##_set_init(prefix##_set *set)                \
+  {                                                                     \
+    if (!set) return HASHSET_ERROR_SET_NULL;                            \
+                                                                        \
+    *set = (prefix##_set) {0};                                          \
+    set->capacity = HASHSET_INITIAL_CAPACITY < HASHSET_GROUP            \
+      ? HASHSET_GROUP : HASHSET_INITIAL_CAPACITY;                       \
+    return prefix##_set_table_new(set->capacity,                        \
+                                  &set->keys, &set->ctrl);              \
+  }                                                                     \
+                                                                        \
+  static inline void prefix##_set_destroy(prefix##_set *set)            \
+  {                                                                     \
+    if (!set) return;                                                   \
+    if (set->keys) HASHSET_FREE(set->keys);                             \
+    if (set->ctrl) HASHSET_FREE(set->ctrl);                             \
+    *set = (prefix##_set) {0};                                          \
+  }                                                                     \
+                                                                        \
+  /* First group to probe for [hash] */                                 \
+  static inline size_t prefix##_set_group(prefix##_set *set,            \
+                                          uint64_t hash)                \
+  {                                                                     \
+    return hash & (set->capacity - 1) & ~(size_t) (HASHSET_GROUP - 1);  \
+  }                                                                     \
+                                                                        \
+  /* Returns the slot of [key], or capacity if it is missing */         \
+  static inline size_t prefix##_set_find(prefix##_set *set,             \
+                                         hashset_u128 key,              \
+                                         uint64_t hash)                 \
+  {                                                                     \
+    uint8_t fp = (uint8_t) (hash >> 57);                                \
+    size_t pos = prefix##_set_group(set, hash);                         \
+    for (size_t n = 0; n < set->capacity; n += HASHSET_GROUP)           \
+    {                                                                   \
+      const uint8_t *ctrl = set->ctrl + pos;                            \
+      for (uint32_t m = hashset_group_match(ctrl, fp); m; m &= m - 1)   \
+      {                                                                 \
+        size_t idx = pos + hashset_ctz(m);                              \
+        if (hashset_u128_eq(set->keys[idx], key)) return idx;           \
+      }                                                                 \
+      if (hashset_group_match(ctrl, HASHSET_CTRL_EMPTY)) break;         \
+      pos = (pos + HASHSET_GROUP) & (set->capacity - 1);                \
+    }                                                                   \
+    return set->capacity;                                               \
+  }                                                                     \
+                                                                        \
+  /* Returns the first empty or deleted slot on the probe of [hash] */  \
+  static inline size_t prefix##_set_find_free(prefix##_set *set,        \
+                                              uint64_t hash)            \
+  {                                                                     \
+    size_t pos = prefix##_set_group(set, hash);                         \
+    for (size_t n = 0; n < set->capacity; n += HASHSET_GROUP)           \
+    {                                                                   \
+      uint32_t m = hashset_group_free(set->ctrl + pos);                 \
+      if (m) return pos + hashset_ctz(m);                               \
+      pos = (pos + HASHSET_GROUP) & (set->capacity - 1);                \
+    }                                                                   \
+    return set->capacity;                                               \
+  }                                                                     \
+                                                                        \
+  static inline int prefix##_set_resize(prefix##_set *set,              \
+                                        size_t newcap)                  \
+  {                                                                     \
+    if (!set) return HASHSET_ERROR_SET_NULL;                            \
+    if (newcap < set->size || newcap < HASHSET_GROUP                    \
+        || (newcap & (newcap - 1)))                                     \
+      return HASHSET_ERROR_FULL;                                        \
+                                                                        \
+    prefix##_set old = *set;                                            \
+    int err = prefix##_set_table_new(newcap, &set->keys, &set->ctrl);   \
+    if (err != HASHSET_OK)                                              \
+    {                                                                   \
+      *set = old;                                                       \
+      return err;                                                       \
+    }                                                                   \
+    set->capacity = newcap;                                             \
+    set->deleted = 0;                                                   \
+    for (size_t i = 0; i < old.capacity; ++i)                           \
+    {                                                                   \
+      if (old.ctrl[i] & 0x80) continue;                                 \
+      size_t idx =                                                      \
+        prefix##_set_find_free(set, hashset_hash_u128(old.keys[i]));    \
+      set->ctrl[idx] = old.ctrl[i];                                     \
+      set->keys[idx] = old.keys[i];                                     \
+    }                                                                   \
+    HASHSET_FREE(old.keys);                                             \
+    HASHSET_FREE(old.ctrl);                                             \
+    return HASHSET_OK;                                                  \
+  }                                                                     \
+                                                                        \
+  static inline bool prefix##_set_insert(prefix##_set *set,             \
+                                         hashset_u128 key)              \
+  {                                                                     \
+    if (!set) return false;                                             \
+                                                                        \
+    uint64_t hash = hashset_hash_u128(key);                             \
+    if (prefix##_set_find(set, key, hash) < set->capacity)              \
+      return false; /* already exists */                                \
+                                                                        \
+    /* Deleted slots count as used, they make probes longer */          \
+    if ((double) (set->size + set->deleted + 1) / set->capacity         \
+        > HASHSET_MAX_LOAD_FACTOR)                                      \
+    {                                                                   \
+      /* Only rehash in place when most of them are deleted */          \
+      size_t newcap = set->capacity;                                    \
+      if ((double) (set->size + 1) / newcap                             \
+          > HASHSET_MAX_LOAD_FACTOR / 2)                                \
+        newcap *= HASHSET_GROWTH_FACTOR;                                \
+      if (prefix##_set_resize(set, newcap) != HASHSET_OK) return false; \
+    }                                                                   \
+                                                                        \
+    size_t idx = prefix##_set_find_free(set, hash);                     \
+    if (idx >= set->capacity) return false;                             \
+    if (set->ctrl[idx] == HASHSET_CTRL_DELETED) set->deleted--;         \
+    set->ctrl[idx] = (uint8_t) (hash >> 57);                            \
+    set->keys[idx] = key;                                               \
+    set->size++;                                                        \
+    return true;                                                        \
+  }                                                                     \
+                                                                        \
+  static inline bool prefix##_set_contains(prefix##_set *set,           \
+                                           hashset_u128 key)            \
+  {                                                                     \
+    if (!set) return false;                                             \
+    return prefix##_set_find(set, key, hashset_hash_u128(key))          \
+      < set->capacity;                                                  \
+  }                                                                     \
+                                                                        \
+  static inline bool prefix##_set_remove(prefix##_set *set,             \
+                                         hashset_u128 key)              \
+  {                                                                     \
+    if (!set) return false;                                             \
+                                                                        \
+    size_t idx = prefix##_set_find(set, key, hashset_hash_u128(key));   \
+    if (idx >= set->capacity) return false;                             \
+                                                                        \
+    /* Probes stop at a group with an empty slot, so the slot can be */ \
+    /* emptied if its group already has one */                          \
+    size_t group = idx & ~(size_t) (HASHSET_GROUP - 1);                 \
+    if (hashset_group_match(set->ctrl + group, HASHSET_CTRL_EMPTY))     \
+      set->ctrl[idx] = HASHSET_CTRL_EMPTY;                              \
+    else                                                                \
+    {                                                                   \
+      set->ctrl[idx] = HASHSET_CTRL_DELETED;                            \
+      set->deleted++;                                                   \
+    }                                                                   \
+    set->size--;                                                        \
+    return true;                                                        \
+  }
+
+#define HASHSET_DECLARE_POINTER(prefix)                                 \
+  typedef struct {                                                      \
+    const void **keys; /* NULL for empty slots */                       \
+    size_t size;                                                        \
+    size_t capacity;                                                    \
+  } prefix##_set;                                                       \
+                                                                        \
+  static inline int prefix##_set_init(prefix##_set *set)                \
+  {                                                                     \
+    if (!set) return HASHSET_ERROR_SET_NULL;                            \
+                                                                        \
+    *set = (prefix##_set) {0};                                          \
+    set->capacity = HASHSET_INITIAL_CAPACITY;                           \
+    set->keys = HASHSET_CALLOC(set->capacity, sizeof(void*));           \
+    if (!set->keys) return HASHSET_ERROR_ALLOCATION;                    \
+    return HASHSET_OK;                                                  \
+  }                                                                     \
+                                                                        \
+  static inline void prefix##_set_destroy(prefix##_set *set)            \
+  {                                                                     \
+    if (!set) return;                                                   \
+    if (set->keys) HASHSET_FREE(set->keys);                             \
+    *set = (prefix##_set) {0};                                          \
+  }                                                                     \
+                                                                        \
+  /* Returns the slot of [key], or the empty slot where it would go */  \
+  static inline size_t prefix##_set_find_slot(prefix##_set *set,        \
+                                              const void *key)          \
+  {                                                                     \
+    size_t mask = set->capacity - 1;                                    \
+    size_t idx = hashset_hash_ptr(key) & mask;                          \
+    while (set->keys[idx] && set->keys[idx] != key)                     \
+      idx = (idx + 1) & mask;                                           \
+    return idx;                                                         \
+  }                                                                     \
+                                                                        \
+  static inline int prefix##_set_resize(prefix##_set *set,              \
+                                        size_t newcap)                  \
+  {                                                                     \
+    if (!set) return HASHSET_ERROR_SET_NULL;                            \
+    if (newcap <= set->size || (newcap & (newcap - 1)))                 \
+      return HASHSET_ERROR_FULL;                                        \
+                                                                        \
+    prefix##_set old = *set;                                            \
+    set->keys = HASHSET_CALLOC(newcap, sizeof(void*));                  \
+    if (!set->keys)                                                     \
+    {                                                                   \
+      set->keys = old.keys;                                             \
+      return HASHSET_ERROR_ALLOCATION;                                  \
+    }                                                                   \
+    set->capacity = newcap;                                             \
+    for (size_t i = 0; i < old.capacity; ++i)                           \
+    {                                                                   \
+      if (!old.keys[i]) continue;                                       \
+      size_t idx = prefix##_set_find_slot(set, old.keys[i]);            \
+      set->keys[idx] = old.keys[i];                                     \
+    }                                                                   \
+    HASHSET_FREE(old.keys);                                             \
+    return HASHSET_OK;                                                  \
+  }                                                                     \
+                                                                        \
+  static inline int prefix##_set_reserve(prefix##_set *set, size_t n)   \
+  {                                                                     \
+    if (!set) return HASHSET_ERROR_SET_NULL;                            \
+    size_t newcap = set->capacity;                                      \
+    while ((double) n / newcap > HASHSET_MAX_LOAD_FACTOR)               \
+      newcap *= 2;                                                      \
+    if (newcap == set->capacity) return HASHSET_OK;                     \
+    return prefix##_set_resize(set, newcap);                            \
+  }                                                                     \
+                                                                        \
+  static inline bool prefix##_set_insert(prefix##_set *set,             \
+                                         const void *key)               \
+  {                                                                     \
+    if (!set || !key) return false;                                     \
+    if ((double) (set->size + 1) / set->capacity                        \
+        > HASHSET_MAX_LOAD_FACTOR                                       \
+        && prefix##_set_resize(set, set->capacity                       \
+                               * HASHSET_GROWTH_FACTOR) != HASHSET_OK)  \
+      return false;                                                     \
+                                                                        \
+    size_t idx = prefix##_set_find_slot(set, key);                      \
+    if (set->keys[idx]) return false; /* already exists */              \
+    set->keys[idx] = key;                                               \
+    set->size++;                                                        \
+    return true;                                                        \
+  }                                                                     \
+                                                                        \
+  static inline bool prefix##_set_contains(prefix##_set *set,           \
+                                           const void *key)             \
+  {                                                                     \
+    if (!set || !key) return false;                                     \
+    size_t idx = prefix##_set_find_slot(set, key);                      \
+    return set->keys[idx] != NULL;                                      \
+  }                                                                     \
+                                                                        \
+  static inline bool prefix##_set_remove(prefix##_set *set,             \
+                                         const void *key)               \
+  {                                                                     \
+    if (!set || !key) return false;                                     \
+    size_t idx = prefix##_set_find_slot(set, key);                      \
+    if (!set->keys[idx]) return false;                                  \
+                                                                        \
+    /* Shift back the following keys instead of leaving tombstones */   \
+    size_t mask = set->capacity - 1;                                    \
+    for (size_t j = (idx + 1) & mask; set->keys[j]; j = (j + 1) & mask) \
+    {                                                                   \
+      size_t home = hashset_hash_ptr(set->keys[j]) & mask;              \
+      if (((j - home) & mask) < ((j - idx) & mask)) continue;           \
+      set->keys[idx] = set->keys[j];                                    \
+      idx = j;                                                          \
+    }                                                                   \
+    set->keys[idx] = NULL;                                              \
+    set->size--;                                                        \
+    return true;                                                        \
+  }                                                                     \
+                                                                        \
+  static inline size_t                                                  \
+  prefix##_set_insert_batch(prefix##_set *set,                          \
+                            const void *const *keys,                    \
+                            size_t n,                                   \
+                            bool *inserted)                             \
+  {                                                                     \
+    if (!set || prefix##_set_reserve(set, set->size + n) != HASHSET_OK) \
+      return 0;                                                         \
+                                                                        \
+    size_t mask = set->capacity - 1;                                    \
+    size_t count = 0;                                                   \
+    for (size_t i = 0; i < n; ++i)                                      \
+    {                                                                   \
+      if (i + HASHSET_PREFETCH_DISTANCE < n)                            \
+      {                                                                 \
+        const void *next = keys[i + HASHSET_PREFETCH_DISTANCE];         \
+        HASHSET_PREFETCH(&set->keys[hashset_hash_ptr(next) & mask]);    \
+      }                                                                 \
+                                                                        \
+      bool added = false;                                               \
+      if (keys[i])                                                      \
+      {                                                                 \
+        size_t idx = prefix##_set_find_slot(set, keys[i]);              \
+        if (!set->keys[idx])                                            \
+        {                                                               \
+          set->keys[idx] = keys[i];                                     \
+          set->size++;                                                  \
+          added = true;                                                 \
+        }                                                               \
+      }                                                                 \
+      if (inserted) inserted[i] = added;                                \
+      count += added;                                                   \
+    }                                                                   \
+    return count;                                                       \
+  }
+
+#define HASHSET_HASH_BITS (sizeof(hashset_hash_t) * 8)
+#define HASHSET_ALIGN_UP(n, align) (((n) + (align) - 1) / (align) * (align))
+
+#define HASHSET_DECLARE_PERSISTENT(prefix, type, hash_fn, eq_fn)        \
+  typedef struct {                                                      \
+    type val;                                                           \
+    unsigned int size;                                                  \
+  } prefix##_pset_entry;                                                \
+                                                                        \
+  /* The entries are followed by the children, nodes deeper than */     \
+  /* HASHSET_HASH_BITS only have entries with the same hash */          \
+  typedef struct prefix##_pset_node {                                   \
+    uint32_t refs;                                                      \
+    uint32_t datamap; /* 5 bits of the hash having an entry */          \
+    uint32_t nodemap; /* 5 bits of the hash having a child */           \
+    uint32_t len;     /* number of entries */                           \
+    prefix##_pset_entry data[];                                         \
+  } prefix##_pset_node;                                                 \
+                                                                        \
+  typedef struct {                                                      \
+    prefix##_pset_node *root;                                           \
+    size_t size;                                                        \
+  } prefix##_pset;                                                      \
+                                                                        \
+  static inline prefix##_pset_node **                                   \
+  prefix##_pset_children(prefix##_pset_node *node)                      \
+  {                                                                     \
+    size_t offset = node->len * sizeof(prefix##_pset_entry);            \
+    offset = HASHSET_ALIGN_UP(offset, sizeof(void*));                   \
+    return (prefix##_pset_node **) ((char*) node->data + offset);       \
+  }                                                                     \
+                                                                        \
+  static inline prefix##_pset_node *                                    \
+  prefix##_pset_node_new(uint32_t len, uint32_t nchild)                 \
+  {                                                                     \
+    size_t size = len * sizeof(prefix##_pset_entry);                    \
+    size = HASHSET_ALIGN_UP(size, sizeof(void*));                       \
+    prefix##_pset_node *node =                                          \
+      HASHSET_CALLOC(1, sizeof(prefix##_pset_node) + size               \
+                        + nchild * sizeof(prefix##_pset_node*));        \
+    if (!node) return NULL;                                             \
+    node->refs = 1;                                                     \
+    node->len = len;                                                    \
+    return node;                                                        \
+  }                                                                     \
+                                                                        \
+  static inline void prefix##_pset_release(prefix##_pset_node *node)    \
+  {                                                                     \
+    if (!node || hashset_ref_dec(&node->refs) != 0) return;             \
+    prefix##_pset_node **children = prefix##_pset_children(node);       \
+    for (unsigned int i = 0; i < hashset_popcount(node->nodemap); ++i)  \
+      prefix##_pset_release(children[i]);                               \
+    HASHSET_FREE(node);                                                 \
+  }                                                                     \
+                                                                        \
+  /* Copies [node] with the entry and the child for [bit] replaced */   \
+  /* by [entry] and [child], or removed if NULL. If [owned], the old */ \
+  /* node is freed and its children are moved, else they are shared */  \
+  static inline prefix##_pset_node *                                    \
+  prefix##_pset_update(prefix##_pset_node *node,                        \
+                       bool owned,                                      \
+                       uint32_t bit,                                    \
+                       const prefix##_pset_entry *entry,                \
+                       prefix##_pset_node *child)                       \
+  {                                                                     \
+    uint32_t datamap = (node->datamap & ~bit) | (entry ? bit : 0);      \
+    uint32_t nodemap = (node->nodemap & ~bit) | (child ? bit : 0);      \
+    prefix##_pset_node *copy =                                          \
+      prefix##_pset_node_new(hashset_popcount(datamap),                 \
+                             hashset_popcount(nodemap));                \
+    if (!copy) return NULL;                                             \
+    copy->datamap = datamap;                                            \
+    copy->nodemap = nodemap;                                            \
+                                                                        \
+    prefix##_pset_node **from = prefix##_pset_children(node);           \
+    prefix##_pset_node **to = prefix##_pset_children(copy);             \
+    uint32_t d = 0, c = 0, old_d = 0, old_c = 0;                        \
+    uint32_t all = node->datamap | node->nodemap | bit;                 \
+    for (uint32_t m = all; m; m &= m - 1)                               \
+    {                                                                   \
+      uint32_t b = m & (~m + 1); /* lowest bit */                       \
+      if (b == bit)                                                     \
+      {                                                                 \
+        if (entry) copy->data[d++] = *entry;                            \
+        if (child) to[c++] = child;                                     \
+        old_d += (node->datamap & b) != 0;                              \
+        old_c += (node->nodemap & b) != 0;                              \
+      }                                                                 \
+      else if (node->datamap & b)                                       \
+        copy->data[d++] = node->data[old_d++];                          \
+      else                                                              \
+      {                                                                 \
+        if (!owned) hashset_ref_inc(&from[old_c]->refs);                \
+        to[c++] = from[old_c++];                                        \
+      }                                                                 \
+    }                                                                   \
+    if (owned) HASHSET_FREE(node);                                      \
+    return copy;                                                        \
+  }                                                                     \
+                                                                        \
+  /* Removes the entry or the child for [bit] from an owned node */     \
+  static inline void prefix##_pset_shrink(prefix##_pset_node *node,     \
+                                          uint32_t bit)                 \
+  {                                                                     \
+    prefix##_pset_node **children = prefix##_pset_children(node);       \
+    uint32_t nchild = hashset_popcount(node->nodemap);                  \
+    if (node->datamap & bit)                                            \
+    {                                                                   \
+      uint32_t i = hashset_popcount(node->datamap & (bit - 1));         \
+      memmove(&node->data[i], &node->data[i + 1],                       \
+              (node->len - i - 1) * sizeof(prefix##_pset_entry));       \
+      node->len--;                                                      \
+      node->datamap &= ~bit;                                            \
+      memmove(prefix##_pset_children(node), children,                   \
+              nchild * sizeof(prefix##_pset_node*));                    \
+      return;                                                           \
+    }                                                                   \
+    uint32_t i = hashset_popcount(node->nodemap & (bit - 1));           \
+    memmove(&children[i], &children[i + 1],                             \
+            (nchild - i - 1) * sizeof(prefix##_pset_node*));            \
+    node->nodemap &= ~bit;                                              \
+  }                                                                     \
+                                                                        \
+  /* Node holding two entries with different keys */                    \
+  static inline prefix##_pset_node *                                    \
+  prefix##_pset_pair(const prefix##_pset_entry *a, hashset_hash_t ha,   \
+                     const prefix##_pset_entry *b, hashset_hash_t hb,   \
+                     unsigned int shift)                                \
+  {                                                                     \
+    prefix##_pset_node *node;                                           \
+    if (shift >= HASHSET_HASH_BITS)                                     \
+    {                                                                   \
+      node = prefix##_pset_node_new(2, 0);                              \
+      if (!node) return NULL;                                           \
+      node->data[0] = *a;                                               \
+      node->data[1] = *b;                                               \
+      return node;                                                      \
+    }                                                                   \
+                                                                        \
+    uint32_t bit_a = (uint32_t) 1 << ((ha >> shift) & 31);              \
+    uint32_t bit_b = (uint32_t) 1 << ((hb >> shift) & 31);              \
+    if (bit_a == bit_b)                                                 \
+    {                                                                   \
+      prefix##_pset_node *child =                                       \
+        prefix##_pset_pair(a, ha, b, hb, shift + 5);                    \
+      if (!child) return NULL;                                          \
+      node = prefix##_pset_node_new(0, 1);                              \
+      if (!node)                                                        \
+      {                                                                 \
+        prefix##_pset_release(child);                                   \
+        return NULL;                                                    \
+      }                                                                 \
+      node->nodemap = bit_a;                                            \
+      prefix##_pset_children(node)[0] = child;                          \
+      return node;                                                      \
+    }                                                                   \
+                                                                        \
+    node = prefix##_pset_node_new(2, 0);                                \
+    if (!node) return NULL;                                             \
+    node->datamap = bit_a | bit_b;                                      \
+    node->data[bit_a < bit_b ? 0 : 1] = *a;                             \
+    node->data[bit_a < bit_b ? 1 : 0] = *b;                             \
+    return node;                                                        \
+  }                                                                     \
+                                                                        \
+  /* Returns the node replacing [node], or NULL on error. Nodes only */ \
+  /* reachable from this version are [owned] and changed in place */    \
+  static inline prefix##_pset_node *                                    \
+  prefix##_pset_insert_node(prefix##_pset_node *node,                   \
+                            const prefix##_pset_entry *entry,           \
+                            hashset_hash_t hash,                        \
+                            unsigned int shift,                         \
+                            bool owned,                                 \
+                            bool *added)                                \
+  {                                                                     \
+    if (shift >= HASHSET_HASH_BITS)                                     \
+    {                                                                   \
+      for (uint32_t i = 0; i < node->len; ++i)                          \
+        if (eq_fn(node->data[i].val, node->data[i].size,                \
+                  entry->val, entry->size))                             \
+          return node;                                                  \
+      prefix##_pset_node *copy =                                        \
+        prefix##_pset_node_new(node->len + 1, 0);                       \
+      if (!copy) return NULL;                                           \
+      memcpy(copy->data, node->data,                                    \
+             node->len * sizeof(prefix##_pset_entry));                  \
+      copy->data[node->len] = *entry;                                   \
+      if (owned) HASHSET_FREE(node);                                    \
+      *added = true;                                                    \
+      return copy;                                                      \
+    }                                                                   \
+                                                                        \
+    uint32_t bit = (uint32_t) 1 << ((hash >> shift) & 31);              \
+    if (node->datamap & bit)                                            \
+    {                                                                   \
+      prefix##_pset_entry *other =                                      \
+        &node->data[hashset_popcount(node->datamap & (bit - 1))];       \
+      if (eq_fn(other->val, other->size, entry->val, entry->size))      \
+        return node;                                                    \
+                                                                        \
+      prefix##_pset_node *child =                                       \
+        prefix##_pset_pair(other, hash_fn(other->val, other->size),     \
+                           entry, hash, shift + 5);                     \
+      if (!child) return NULL;                                          \
+      prefix##_pset_node *copy =                                        \
+        prefix##_pset_update(node, owned, bit, NULL, child);            \
+      if (!copy)                                                        \
+      {                                                                 \
+        prefix##_pset_release(child);                                   \
+        return NULL;                                                    \
+      }                                                                 \
+      *added = true;                                                    \
+      return copy;                                                      \
+    }                                                                   \
+                                                                        \
+    if (node->nodemap & bit)                                            \
+    {                                                                   \
+      prefix##_pset_node **slot = prefix##_pset_children(node)          \
+        + hashset_popcount(node->nodemap & (bit - 1));                  \
+      prefix##_pset_node *child = *slot;                                \
+      bool child_owned = owned && hashset_ref_get(&child->refs) == 1;   \
+      prefix##_pset_node *next =                                        \
+        prefix##_pset_insert_node(child, entry, hash, shift + 5,        \
+                                  child_owned, added);                  \
+      if (!next) return NULL;                                           \
+      if (next == child) return node;                                   \
+      if (owned)                                                        \
+      {                                                                 \
+        if (!child_owned) prefix##_pset_release(child);                 \
+        *slot = next;                                                   \
+        return node;                                                    \
+      }                                                                 \
+      prefix##_pset_node *copy =                                        \
+        prefix##_pset_update(node, false, bit, NULL, next);             \
+      if (!copy) prefix##_pset_release(next);                           \
+      return copy;                                                      \
+    }                                                                   \
+                                                                        \
+    prefix##_pset_node *copy =                                          \
+      prefix##_pset_update(node, owned, bit, entry, NULL);              \
+    if (copy) *added = true;                                            \
+    return copy;                                                        \
+  }                                                                     \
+                                                                        \
+  /* Returns the node replacing [node], NULL if it became empty. */     \
+  /* [status] is 1 if [key] was removed, 0 if it was not found, */      \
+  /* or a negative integer on error */                                  \
+  static inline prefix##_pset_node *                                    \
+  prefix##_pset_remove_node(prefix##_pset_node *node,                   \
+                            type key,                                   \
+                            unsigned int key_len,                       \
+                            hashset_hash_t hash,                        \
+                            unsigned int shift,                         \
+                            bool owned,                                 \
+                            int *status)                                \
+  {                                                                     \
+    if (shift >= HASHSET_HASH_BITS)                                     \
+    {                                                                   \
+      uint32_t i = 0;                                                   \
+      while (i < node->len                                              \
+             && !eq_fn(node->data[i].val, node->data[i].size,           \
+                       key, key_len))                                   \
+        i++;                                                            \
+      if (i == node->len) return node;                                  \
+      *status = 1;                                                      \
+      if (node->len == 1)                                               \
+      {                                                                 \
+        if (owned) HASHSET_FREE(node);                                  \
+        return NULL;                                                    \
+      }                                                                 \
+      if (owned)                                                        \
+      {                                                                 \
+        node->data[i] = node->data[--node->len];                        \
+        return node;                                                    \
+      }                                                                 \
+      prefix##_pset_node *copy =                                        \
+        prefix##_pset_node_new(node->len - 1, 0);                       \
+      if (!copy)                                                        \
+      {                                                                 \
+        *status = HASHSET_ERROR_ALLOCATION;                             \
+        return node;                                                    \
+      }                                                                 \
+      memcpy(copy->data, node->data, i * sizeof(prefix##_pset_entry));  \
+      memcpy(copy->data + i, node->data + i + 1,                        \
+             (node->len - i - 1) * sizeof(prefix##_pset_entry));        \
+      return copy;                                                      \
+    }                                                                   \
+                                                                        \
+    uint32_t bit = (uint32_t) 1 << ((hash >> shift) & 31);              \
+    if (node->datamap & bit)                                            \
+    {                                                                   \
+      prefix##_pset_entry *other =                                      \
+        &node->data[hashset_popcount(node->datamap & (bit - 1))];       \
+      if (!eq_fn(other->val, other->size, key, key_len)) return node;   \
+      *status = 1;                                                      \
+      if (node->len == 1 && node->nodemap == 0)                         \
+      {                                                                 \
+        if (owned) HASHSET_FREE(node);                                  \
+        return NULL;                                                    \
+      }                                                                 \
+      if (owned)                                                        \
+      {                                                                 \
+        prefix##_pset_shrink(node, bit);                                \
+        return node;                                                    \
+      }                                                                 \
+      prefix##_pset_node *copy =                                        \
+        prefix##_pset_update(node, false, bit, NULL, NULL);             \
+      if (!copy) *status = HASHSET_ERROR_ALLOCATION;                    \
+      return copy ? copy : node;                                        \
+    }                                                                   \
+    if (!(node->nodemap & bit)) return node;                            \
+                                                                        \
+    prefix##_pset_node **slot = prefix##_pset_children(node)            \
+      + hashset_popcount(node->nodemap & (bit - 1));                    \
+    prefix##_pset_node *child = *slot;                                  \
+    bool child_owned = owned && hashset_ref_get(&child->refs) == 1;     \
+    prefix##_pset_node *next =                                          \
+      prefix##_pset_remove_node(child, key, key_len, hash, shift + 5,   \
+                                child_owned, status);                   \
+    if (*status != 1) return node;                                      \
+                                                                        \
+    if (owned && !child_owned) prefix##_pset_release(child);            \
+                                                                        \
+    prefix##_pset_node *copy;                                           \
+    if (next && next->len == 1 && next->nodemap == 0)                   \
+    {                                                                   \
+      /* Move the last entry of a child up, keeping the trie compact */ \
+      copy = prefix##_pset_update(node, owned, bit, next->data, NULL);  \
+      if (copy)                                                         \
+      {                                                                 \
+        prefix##_pset_release(next);                                    \
+        return copy;                                                    \
+      }                                                                 \
+      if (owned)                                                        \
+      {                                                                 \
+        *slot = next; /* still correct, only less compact */            \
+        return node;                                                    \
+      }                                                                 \
+      prefix##_pset_release(next);                                      \
+      *status = HASHSET_ERROR_ALLOCATION;                               \
+      return node;                                                      \
+    }                                                                   \
+                                                                        \
+    if (!next && node->len == 0 && node->nodemap == bit)                \
+    {                                                                   \
+      if (owned) HASHSET_FREE(node);                                    \
+      return NULL;                                                      \
+    }                                                                   \
+    if (owned)                                                          \
+    {                                                                   \
+      if (next) *slot = next;                                           \
+      else prefix##_pset_shrink(node, bit);                             \
+      return node;                                                      \
+    }                                                                   \
+    copy = prefix##_pset_update(node, false, bit, NULL, next);          \
+    if (!copy)                                                          \
+    {                                                                   \
+      prefix##_pset_release(next);                                      \
+      *status = HASHSET_ERROR_ALLOCATION;                               \
+      return node;                                                      \
+    }                                                                   \
+    return copy;                                                        \
+  }                                                                     \
+                                                                        \
+  static inline int prefix##_pset_init(prefix##_pset *set)              \
+  {                                                                     \
+    if (!set) return HASHSET_ERROR_SET_NULL;                            \
+    *set = (prefix##_pset){0};                                          \
+    return HASHSET_OK;                                                  \
+  }                                                                     \
+                                                                        \
+  static inline void prefix##_pset_destroy(prefix##_pset *set)          \
+  {                                                                     \
+    if (!set) return;                                                   \
+    prefix##_pset_release(set->root);                                   \
+    *set = (prefix##_pset){0};                                          \
+  }                                                                     \
+                                                                        \
+  static inline prefix##_pset                                           \
+  prefix##_pset_snapshot(prefix##_pset *set)                            \
+  {                                                                     \
+    if (!set) return (prefix##_pset){0};                                \
+    if (set->root) hashset_ref_inc(&set->root->refs);                   \
+    return *set;                                                        \
+  }                                                                     \
+                                                                        \
+  static inline size_t prefix##_pset_size(prefix##_pset *set)           \
+  {                                                                     \
+    return set ? set->size : 0;                                         \
+  }                                                                     \
+                                                                        \
+  static inline int prefix##_pset_add(prefix##_pset *set,               \
+                                      type key,                         \
+                                      unsigned int key_len)             \
+  {                                                                     \
+    if (!set) return HASHSET_ERROR_SET_NULL;                            \
+                                                                        \
+    prefix##_pset_entry entry = {.val = key, .size = key_len};          \
+    hashset_hash_t hash = hash_fn(key, key_len);                        \
+    if (!set->root)                                                     \
+    {                                                                   \
+      set->root = prefix##_pset_node_new(1, 0);                         \
+      if (!set->root) return HASHSET_ERROR_ALLOCATION;                  \
+      set->root->datamap = (uint32_t) 1 << (hash & 31);                 \
+      set->root->data[0] = entry;                                       \
+      set->size = 1;                                                    \
+      return 1;                                                         \
+    }                                                                   \
+                                                                        \
+    bool added = false;                                                 \
+    bool owned = hashset_ref_get(&set->root->refs) == 1;                \
+    prefix##_pset_node *root =                                          \
+      prefix##_pset_insert_node(set->root, &entry, hash, 0,             \
+                                owned, &added);                         \
+    if (!root) return HASHSET_ERROR_ALLOCATION;                         \
+    if (!added) return 0;                                               \
+    if (root != set->root && !owned) prefix##_pset_release(set->root);  \
+    set->root = root;                                                   \
+    set->size++;                                                        \
+    return 1;                                                           \
+  }                                                                     \
+                                                                        \
+  static inline bool prefix##_pset_insert(prefix##_pset *set,           \
+                                          type key,                     \
+                                          unsigned int key_len)         \
+  {                                                                     \
+    return prefix##_pset_add(set, key, key_len) == 1;                   \
+  }                                                                     \
+                                                                        \
+  static inline int                                                     \
+  prefix##_pset_insert_batch(prefix##_pset *set,                        \
+                             const type *keys,                          \
+                             const unsigned int *key_lens,              \
+                             size_t n)                                  \
+  {                                                                     \
+    for (size_t i = 0; i < n; ++i)                                      \
+    {                                                                   \
+      unsigned int key_len = key_lens ? key_lens[i] : 0;                \
+      int err = prefix##_pset_add(set, keys[i], key_len);               \
+      if (err < 0) return err;                                          \
+    }                                                                   \
+    return HASHSET_OK;                                                  \
+  }                                                                     \
+                                                                        \
+  static inline bool prefix##_pset_remove(prefix##_pset *set,           \
+                                          type key,                     \
+                                          unsigned int key_len)         \
+  {                                                                     \
+    if (!set || !set->root) return false;                               \
+                                                                        \
+    int status = 0;                                                     \
+    bool owned = hashset_ref_get(&set->root->refs) == 1;                \
+    prefix##_pset_node *root =                                          \
+      prefix##_pset_remove_node(set->root, key, key_len,                \
+                                hash_fn(key, key_len), 0,               \
+                                owned, &status);                        \
+    if (status != 1) return false;                                      \
+    if (root != set->root && !owned) prefix##_pset_release(set->root);  \
+    set->root = root;                                                   \
+    set->size--;                                                        \
+    return true;                                                        \
+  }                                                                     \
+                                                                        \
+  static inline bool prefix##_pset_contains(prefix##_pset *set,         \
+                                            type key,                   \
+                                            unsigned int key_len)       \
+  {                                                                     \
+    if (!set) return false;                                             \
+                                                                        \
+    hashset_hash_t hash = hash_fn(key, key_len);                        \
+    prefix##_pset_node *node = set->root;                               \
+    for (unsigned int shift = 0; node; shift += 5)                      \
+    {                                                                   \
+      if (shift >= HASHSET_HASH_BITS)                                   \
+      {                                                                 \
+        for (uint32_t i = 0; i < node->len; ++i)                        \
+          if (eq_fn(node->data[i].val, node->data[i].size,              \
+                    key, key_len))                                      \
+            return true;                                                \
+        return false;                                                   \
+      }                                                                 \
+                                                                        \
+      uint32_t bit = (uint32_t) 1 << ((hash >> shift) & 31);            \
+      if (node->datamap & bit)                                          \
+      {                                                                 \
+        prefix##_pset_entry *entry =                                    \
+          &node->data[hashset_popcount(node->datamap & (bit - 1))];     \
+        return eq_fn(entry->val, entry->size, key, key_len);            \
+      }                                                                 \
+      if (!(node->nodemap & bit)) return false;                         \
+      node = prefix##_pset_children(node)                               \
+        [hashset_popcount(node->nodemap & (bit - 1))];                  \
+    }                                                                   \
+    return false;                                                       \
+  }
+
+#ifdef HASHSET_THREADS
+
+// The same as the trace, so that the combiner records them as they are
+#define HASHSET_FC_INSERT   HASHSET_TRACE_INSERT
+#define HASHSET_FC_CONTAINS HASHSET_TRACE_CONTAINS
+#define HASHSET_FC_REMOVE   HASHSET_TRACE_REMOVE
+
+#define HASHSET_DECLARE_FLAT_COMBINING(prefix, type)                    \
+  typedef struct {                                                      \
+    type key;                                                           \
+    unsigned int key_len;                                               \
+    int op;                                                             \
+    int pending; /* set by the owner, cleared by the combiner */        \
+    bool result;                                                        \
+  } prefix##_fc_request;                                                \
+                                                                        \
+  /* Keep the requests of different threads on different lines */       \
+  typedef struct {                                                      \
+    prefix##_fc_request req;                                            \
+  } __attribute__((aligned(64))) prefix##_fc_slot;                      \
+                                                                        \
+  typedef struct {                                                      \
+    prefix##_set set;                                                   \
+    pthread_mutex_t lock; /* held by the combiner */                    \
+    int busy; /* set while a thread combines */                         \
+    int nslots;                                                         \
+    prefix##_fc_slot slots[HASHSET_FC_SLOTS];                           \
+  } prefix##_fc_set;                                                    \
+                                                                        \
+  static inline int prefix##_fc_set_init(prefix##_fc_set *fc)           \
+  {                                                                     \
+    if (!fc) return HASHSET_ERROR_SET_NULL;                             \
+                                                                        \
+    memset(fc->slots, 0, sizeof(fc->slots));                            \
+    fc->busy = 0;                                                       \
+    fc->nslots = 0;                                                     \
+    if (pthread_mutex_init(&fc->lock, NULL) != 0)                       \
+      return HASHSET_ERROR_ALLOCATION;                                  \
+    int err = prefix##_set_init(&fc->set);                              \
+    if (err != HASHSET_OK)                                              \
+      pthread_mutex_destroy(&fc->lock);                                 \
+    return err;                                                         \
+  }                                                                     \
+                                                                        \
+  static inline void prefix##_fc_set_destroy(prefix##_fc_set *fc)       \
+  {                                                                     \
+    if (!fc) return;                                                    \
+                                                                        \
+    prefix##_set_destroy(&fc->set);                                     \
+    pthread_mutex_destroy(&fc->lock);                                   \
+  }                                                                     \
+                                                                        \
+  static inline int prefix##_fc_set_register(prefix##_fc_set *fc)       \
+  {                                                                     \
+    if (!fc) return HASHSET_ERROR_SET_NULL;                             \
+                                                                        \
+    int slot = __atomic_load_n(&fc->nslots, __ATOMIC_RELAXED);          \
+    do {                                                                \
+      if (slot >= HASHSET_FC_SLOTS) return HASHSET_ERROR_FULL;          \
+    } while (!__atomic_compare_exchange_n(&fc->nslots, &slot, slot + 1, \
+                                          false, __ATOMIC_ACQ_REL,      \
+                                          __ATOMIC_RELAXED));           \
+    return slot;                                                        \
+  }                                                                     \
+                                                                        \
+  static inline void prefix##_fc_set_combine(prefix##_fc_set *fc)       \
+  {                                                                     \
+    int todo[HASHSET_FC_SLOTS];                                         \
+    hashset_hash_t hashes[HASHSET_FC_SLOTS];                            \
+    int nslots = __atomic_load_n(&fc->nslots, __ATOMIC_ACQUIRE);        \
+    size_t mask = fc->set.capacity - 1;                                 \
+    int n = 0;                                                          \
+                                                                        \
+    /* Hash and prefetch all the pending requests, then probe */        \
+    for (int i = 0; i < nslots; ++i)                                    \
+    {                                                                   \
+      prefix##_fc_request *req = &fc->slots[i].req;                     \
+      if (!__atomic_load_n(&req->pending, __ATOMIC_ACQUIRE)) continue;  \
+      hashes[n] = prefix##_set_hash(req->key, req->key_len);            \
+      HASHSET_PREFETCH(&fc->set.state[hashes[n] & mask]);               \
+      HASHSET_PREFETCH(&fc->set.data[hashes[n] & mask]);                \
+      todo[n++] = i;                                                    \
+    }                                                                   \
+                                                                        \
+    for (int k = 0; k < n; ++k)                                         \
+    {                                                                   \
+      prefix##_fc_request *req = &fc->slots[todo[k]].req;               \
+      switch (req->op)                                                  \
+      {                                                                 \
+      case HASHSET_FC_INSERT:                                           \
+        req->result = prefix##_set_insert_hashed(&fc->set, req->key,    \
+                                                 req->key_len,          \
+                                                 hashes[k]);            \
+        break;                                                          \
+      case HASHSET_FC_CONTAINS:                                         \
+        req->result = prefix##_set_contains_hashed(&fc->set, req->key,  \
+                                                   req->key_len,        \
+                                                   hashes[k]);          \
+        break;                                                          \
+      default:                                                          \
+        req->result = prefix##_set_remove_hashed(&fc->set, req->key,    \
+                                                 req->key_len,          \
+                                                 hashes[k]);            \
+        break;                                                          \
+      }                                                                 \
+      HASHSET_TRACE_CALL(&fc->set, req->op, &req->key, sizeof(type),    \
+                         req->key_len, hashes[k], req->result);         \
+      __atomic_store_n(&req->pending, 0, __ATOMIC_RELEASE);             \
+    }                                                                   \
+  }                                                                     \
+                                                                        \
+  static inline bool prefix##_fc_set_apply(prefix##_fc_set *fc,         \
+                                           int slot,                    \
+                                           int op,                      \
+                                           type key,                    \
+                                           unsigned int key_len)        \
+  {                                                                     \
+    if (!fc || slot < 0 || slot >= HASHSET_FC_SLOTS) return false;      \
+                                                                        \
+    prefix##_fc_request *req = &fc->slots[slot].req;                    \
+    req->key = key;                                                     \
+    req->key_len = key_len;                                             \
+    req->op = op;                                                       \
+    __atomic_store_n(&req->pending, 1, __ATOMIC_RELEASE);               \
+                                                                        \
+    for (unsigned int spins = 1;                                        \
+         __atomic_load_n(&req->pending, __ATOMIC_ACQUIRE); ++spins)     \
+    {                                                                   \
+      /* Spin on our own line while another thread combines, and        \
+         only go for the lock once it looks free */                     \
+      if (!__atomic_load_n(&fc->busy, __ATOMIC_RELAXED)                 \
+          && pthread_mutex_trylock(&fc->lock) == 0)                     \
+      {                                                                 \
+        __atomic_store_n(&fc->busy, 1, __ATOMIC_RELAXED);               \
+        /* Our request is published, the combiner applies it too */     \
+        prefix##_fc_set_combine(fc);                                    \
+        __atomic_store_n(&fc->busy, 0, __ATOMIC_RELAXED);               \
+        pthread_mutex_unlock(&fc->lock);                                \
+        break;                                                          \
+      }                                                                 \
+      if (spins % 128 == 0) sched_yield();                              \
+    }                                                                   \
+    return req->result;                                                 \
+  }                                                                     \
+                                                                        \
+  static inline bool prefix##_fc_set_insert(prefix##_fc_set *fc,        \
+                                            int slot,                   \
+                                            type key,                   \
+                                            unsigned int key_len)       \
+  {                                                                     \
+    return prefix##_fc_set_apply(fc, slot, HASHSET_FC_INSERT,           \
+                                 key, key_len);                         \
+  }                                                                     \
+                                                                        \
+  static inline bool prefix##_fc_set_contains(prefix##_fc_set *fc,      \
+                                              int slot,                 \
+                                              type key,                 \
+                                              unsigned int key_len)     \
+  {                                                                     \
+    return prefix##_fc_set_apply(fc, slot, HASHSET_FC_CONTAINS,         \
+                                 key, key_len);                         \
+  }                                                                     \
+                                                                        \
+  static inline bool prefix##_fc_set_remove(prefix##_fc_set *fc,        \
+                                            int slot,                   \
+                                            type key,                   \
+                                            unsigned int key_len)       \
+  {                                                                     \
+    return prefix##_fc_set_apply(fc, slot, HASHSET_FC_REMOVE,           \
+                                 key, key_len);                         \
+  }
+
+#define HASHSET_GSET_COUNTERS 16
+
+typedef struct {
+  size_t n;
+  char pad[64 - sizeof(size_t)];
+} hashset_counter;
+
+#define HASHSET_DECLARE_GROW_ONLY(prefix, type, hash_fn, eq_fn)         \
+  typedef struct {                                                      \
+    type val;                                                           \
+    unsigned int size;                                                  \
+  } prefix##_gset_entry;                                                \
+                                                                        \
+  typedef struct prefix##_gset_table {                                  \
+    prefix##_gset_entry *data;                                          \
+    /* 0=empty,1=being written,2=used,3=moved empty,4=moved used */     \
+    uint8_t *state;                                                     \
+    size_t capacity;                                                    \
+    size_t next_chunk;  /* next chunk to migrate */                     \
+    size_t done_chunks; /* chunks migrated */                           \
+    struct prefix##_gset_table *next; /* table being migrated to */     \
+    struct prefix##_gset_table *prev; /* kept until destroy */          \
+  } prefix##_gset_table;                                                \
+                                                                        \
+  typedef struct {                                                      \
+    prefix##_gset_table *table;                                         \
+    hashset_counter count[HASHSET_GSET_COUNTERS];                       \
+  } prefix##_gset;                                                      \
+                                                                        \
+  static inline prefix##_gset_table *                                   \
+  prefix##_gset_table_new(size_t capacity, prefix##_gset_table *prev)   \
+  {                                                                     \
+    prefix##_gset_table *t = HASHSET_CALLOC(1, sizeof(*t));             \
+    if (!t) return NULL;                                                \
+    t->data = HASHSET_CALLOC(capacity, sizeof(prefix##_gset_entry));    \
+    t->state = HASHSET_CALLOC(capacity, sizeof(uint8_t));               \
+    if (!t->data || !t->state)                                          \
+    {                                                                   \
+      if (t->data) HASHSET_FREE(t->data);                               \
+      if (t->state) HASHSET_FREE(t->state);                             \
+      HASHSET_FREE(t);                                                  \
+      return NULL;                                                      \
+    }                                                                   \
+    t->capacity = capacity;                                             \
+    t->prev = prev;                                                     \
+    return t;                                                           \
+  }                                                                     \
+                                                                        \
+  static inline int prefix##_gset_init(prefix##_gset *set)              \
+  {                                                                     \
+    if (!set) return HASHSET_ERROR_SET_NULL;                            \
+                                                                        \
+    memset(set->count, 0, sizeof(set->count));                          \
+    set->table =                                                        \
+      prefix##_gset_table_new(HASHSET_INITIAL_CAPACITY, NULL);          \
+    if (!set->table) return HASHSET_ERROR_ALLOCATION;                   \
+    return HASHSET_OK;                                                  \
+  }                                                                     \
+                                                                        \
+  static inline void prefix##_gset_destroy(prefix##_gset *set)          \
+  {                                                                     \
+    if (!set) return;                                                   \
+                                                                        \
+    prefix##_gset_table *t = set->table;                                \
+    while (t)                                                           \
+    {                                                                   \
+      prefix##_gset_table *prev = t->prev;                              \
+      HASHSET_FREE(t->data);                                            \
+      HASHSET_FREE(t->state);                                           \
+      HASHSET_FREE(t);                                                  \
+      t = prev;                                                         \
+    }                                                                   \
+    set->table = NULL;                                                  \
+  }                                                                     \
+                                                                        \
+  static inline size_t prefix##_gset_size(prefix##_gset *set)           \
+  {                                                                     \
+    if (!set) return 0;                                                 \
+                                                                        \
+    size_t size = 0;                                                    \
+    for (int i = 0; i < HASHSET_GSET_COUNTERS; ++i)                     \
+      size += __atomic_load_n(&set->count[i].n, __ATOMIC_RELAXED);      \
+    return size;                                                        \
+  }                                                                     \
+                                                                        \
+  static inline uint8_t prefix##_gset_wait(uint8_t *state)              \
+  {                                                                     \
+    uint8_t st;                                                         \
+    for (unsigned int spins = 1;                                        \
+         (st = __atomic_load_n(state, __ATOMIC_ACQUIRE)) == 1; ++spins) \
+      if (spins % 128 == 0) sched_yield();                              \
+    return st;                                                          \
+  }                                                                     \
+                                                                        \
+  static inline void prefix##_gset_migrate(prefix##_gset_table *t)      \
+  {                                                                     \
+    prefix##_gset_table *next = __atomic_load_n(&t->next,               \
+                                                __ATOMIC_ACQUIRE);      \
+    size_t mask = next->capacity - 1;                                   \
+    size_t nchunks = (t->capacity + HASHSET_MIGRATE_CHUNK - 1)          \
+                     / HASHSET_MIGRATE_CHUNK;                           \
+                                                                        \
+    size_t chunk;                                                       \
+    while ((chunk = __atomic_fetch_add(&t->next_chunk, 1,               \
+                                       __ATOMIC_ACQ_REL)) < nchunks)    \
+    {                                                                   \
+      size_t end = (chunk + 1) * HASHSET_MIGRATE_CHUNK;                 \
+      if (end > t->capacity) end = t->capacity;                         \
+      for (size_t i = chunk * HASHSET_MIGRATE_CHUNK; i < end; ++i)      \
+      {                                                                 \
+        /* Freeze empty slots, wait for the writers of busy ones */     \
+        uint8_t st = 0;                                                 \
+        if (__atomic_compare_exchange_n(&t->state[i], &st, 3, false,    \
+                                        __ATOMIC_ACQ_REL,               \
+                                        __ATOMIC_ACQUIRE))              \
+          continue;                                                     \
+        if (prefix##_gset_wait(&t->state[i]) != 2) continue;            \
+                                                                        \
+        /* Keys are unique, claim the first free slot */                \
+        size_t idx = hash_fn(t->data[i].val, t->data[i].size) & mask;   \
+        for (;; idx = (idx + 1) & mask)                                 \
+        {                                                               \
+          uint8_t empty = 0;                                            \
+          if (__atomic_compare_exchange_n(&next->state[idx], &empty, 1, \
+                                          false, __ATOMIC_ACQ_REL,      \
+                                          __ATOMIC_RELAXED))            \
+            break;                                                      \
+        }                                                               \
+        next->data[idx] = t->data[i];                                   \
+        __atomic_store_n(&next->state[idx], 2, __ATOMIC_RELEASE);       \
+        __atomic_store_n(&t->state[i], 4, __ATOMIC_RELEASE);            \
+      }                                                                 \
+      __atomic_fetch_add(&t->done_chunks, 1, __ATOMIC_ACQ_REL);         \
+    }                                                                   \
+                                                                        \
+    for (unsigned int spins = 1;                                        \
+         __atomic_load_n(&t->done_chunks, __ATOMIC_ACQUIRE) < nchunks;  \
+         ++spins)                                                       \
+      if (spins % 128 == 0) sched_yield();                              \
+  }                                                                     \
+                                                                        \
+  static inline int prefix##_gset_grow(prefix##_gset *set,              \
+                                       prefix##_gset_table *t)          \
+  {                                                                     \
+    prefix##_gset_table *next = __atomic_load_n(&t->next,               \
+                                                __ATOMIC_ACQUIRE);      \
+    if (!next)                                                          \
+    {                                                                   \
+      prefix##_gset_table *expected = NULL;                             \
+      next = prefix##_gset_table_new(t->capacity                        \
+                                     * HASHSET_GROWTH_FACTOR, t);       \
+      if (!next) return HASHSET_ERROR_ALLOCATION;                       \
+      if (!__atomic_compare_exchange_n(&t->next, &expected, next,       \
+                                       false, __ATOMIC_ACQ_REL,         \
+                                       __ATOMIC_ACQUIRE))               \
+      {                                                                 \
+        HASHSET_FREE(next->data);                                       \
+        HASHSET_FREE(next->state);                                      \
+        HASHSET_FREE(next);                                             \
+      }                                                                 \
+    }                                                                   \
+                                                                        \
+    prefix##_gset_migrate(t);                                           \
+    prefix##_gset_table *expected = t;                                  \
+    next = __atomic_load_n(&t->next, __ATOMIC_ACQUIRE);                 \
+    __atomic_compare_exchange_n(&set->table, &expected, next, false,    \
+                                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);    \
+    return HASHSET_OK;                                                  \
+  }                                                                     \
+                                                                        \
+  /* Returns 1 if found, 0 if inserted, -1 if [t] is being migrated */  \
+  static inline int prefix##_gset_probe(prefix##_gset_table *t,         \
+                                        type key,                       \
+                                        unsigned int key_len,           \
+                                        hashset_hash_t hash,            \
+                                        bool insert)                    \
+  {                                                                     \
+    size_t mask = t->capacity - 1;                                      \
+    size_t idx = hash & mask;                                           \
+    for (size_t n = 0; n < t->capacity; ++n)                            \
+    {                                                                   \
+      uint8_t st = 0;                                                   \
+      if (insert                                                        \
+          && __atomic_compare_exchange_n(&t->state[idx], &st, 1, false, \
+                                         __ATOMIC_ACQ_REL,              \
+                                         __ATOMIC_ACQUIRE))             \
+      {                                                                 \
+        t->data[idx] =                                                  \
+          (prefix##_gset_entry) {.val = key, .size = key_len};          \
+        __atomic_store_n(&t->state[idx], 2, __ATOMIC_RELEASE);          \
+        return 0;                                                       \
+      }                                                                 \
+      st = prefix##_gset_wait(&t->state[idx]);                          \
+      if (st == 0) return -2; /* not found */                           \
+      if (st == 3) return -1;                                           \
+      if (HASHSET_SIZE_EQ(t->data[idx].size, key_len)                   \
+          && eq_fn(t->data[idx].val, t->data[idx].size, key, key_len))  \
+        return 1;                                                       \
+      idx = (idx + 1) & mask;                                           \
+    }                                                                   \
+    return -1; /* full */                                               \
+  }                                                                     \
+                                                                        \
+  static inline int prefix##_gset_test_and_insert(prefix##_gset *set,   \
+                                                  type key,             \
+                                                  unsigned int key_len) \
+  {                                                                     \
+    if (!set) return HASHSET_ERROR_SET_NULL;                            \
+                                                                        \
+    hashset_hash_t hash = hash_fn(key, key_len);                        \
+    hashset_counter *count = &set->count[hash % HASHSET_GSET_COUNTERS]; \
+    for (;;)                                                            \
+    {                                                                   \
+      prefix##_gset_table *t = __atomic_load_n(&set->table,             \
+                                               __ATOMIC_ACQUIRE);       \
+      int found = prefix##_gset_probe(t, key, key_len, hash, true);     \
+      if (found == 1) return 1;                                         \
+      if (found == 0)                                                   \
+      {                                                                 \
+        /* Check the total only when this counter looks high */         \
+        size_t n = __atomic_add_fetch(&count->n, 1, __ATOMIC_RELAXED);  \
+        double limit = t->capacity * HASHSET_MAX_LOAD_FACTOR;           \
+        if (n * HASHSET_GSET_COUNTERS > limit                           \
+            && prefix##_gset_size(set) > limit                          \
+            && t == __atomic_load_n(&set->table, __ATOMIC_ACQUIRE))     \
+          prefix##_gset_grow(set, t);                                   \
+        return 0;                                                       \
+      }                                                                 \
+      int err = prefix##_gset_grow(set, t);                             \
+      if (err != HASHSET_OK) return err;                                \
+    }                                                                   \
+  }                                                                     \
+                                                                        \
+  static inline bool prefix##_gset_insert(prefix##_gset *set,           \
+                                          type key,                     \
+                                          unsigned int key_len)         \
+  {                                                                     \
+    return prefix##_gset_test_and_insert(set, key, key_len) == 0;       \
+  }                                                                     \
+                                                                        \
+  static inline bool prefix##_gset_contains(prefix##_gset *set,         \
+                                            type key,                   \
+                                            unsigned int key_len)       \
+  {                                                                     \
+    if (!set) return false;                                             \
+                                                                        \
+    hashset_hash_t hash = hash_fn(key, key_len);                        \
+    for (;;)                                                            \
+    {                                                                   \
+      prefix##_gset_table *t = __atomic_load_n(&set->table,             \
+                                               __ATOMIC_ACQUIRE);       \
+      int found = prefix##_gset_probe(t, key, key_len, hash, false);    \
+      if (found != -1) return found == 1;                               \
+      if (prefix##_gset_grow(set, t) != HASHSET_OK) return false;       \
+    }                                                                   \
+  }
+
+#endif // HASHSET_THREADS
+
+//
+// Function Declarations
+//
+
+// Some sample hash functions
+// You need to #define HASHSET_IMPLEMENTATION to use them.
+  
+// char* key hash function
+// Credits to http://www.cse.yorku.ca/~oz/hash.html
+unsigned long hashset_hash_char(char *bytes, unsigned int len);
+
+// uint32_t key hash function
+uint32_t hashset_hash_int32(uint32_t a, unsigned int ignored);
+
+// char* key eq function, compares the lengths first, then the first
+// 8 bytes, then the rest 16 bytes at a time
+bool hashset_eq_bytes(char *a, unsigned int a_len,
+                      char *b, unsigned int b_len);
+  
+//
+// Implementation
+//
+
+#ifdef HASHSET_IMPLEMENTATION
+
+unsigned long hashset_hash_char(char *bytes, unsigned int len)
+{
+  unsigned long hash = 5381;
+  for (unsigned int i = 0; i < len; ++i)
+    hash = hash * 33 + bytes[i];
+  return hash;
+}
+
+uint32_t hashset_hash_int32(uint32_t a, unsigned int ignored)
 {
     a = (a ^ 61) ^ (a >> 16);
     a = a + (a << 3);
@@ -360,6 +3758,44 @@ uint32_t hashset_hash_int32(uint32_t a, unsigned int ignored)
     return a;
 }
 
+bool hashset_eq_bytes(char *a, unsigned int a_len,
+                      char *b, unsigned int b_len)
+{
+  if (a_len != b_len) return false;
+  if (a == b) return true;
+  if (a_len < 8) return memcmp(a, b, a_len) == 0;
+
+  // Most keys that differ do it in the first bytes
+  uint64_t x, y;
+  memcpy(&x, a, 8);
+  memcpy(&y, b, 8);
+  if (x != y) return false;
+
+#ifdef __SSE2__
+  unsigned int i = 8;
+  for (; i + 16 <= a_len; i += 16)
+  {
+    __m128i va = _mm_loadu_si128((const __m128i*) (a + i));
+    __m128i vb = _mm_loadu_si128((const __m128i*) (b + i));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) != 0xffff) return false;
+  }
+  if (i == a_len) return true;
+
+  // Compare the last bytes again, overlapping the ones already seen
+  if (a_len >= 16)
+  {
+    __m128i va = _mm_loadu_si128((const __m128i*) (a + a_len - 16));
+    __m128i vb = _mm_loadu_si128((const __m128i*) (b + a_len - 16));
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) == 0xffff;
+  }
+  memcpy(&x, a + a_len - 8, 8);
+  memcpy(&y, b + a_len - 8, 8);
+  return x == y;
+#else
+  return memcmp(a + 8, b + 8, a_len - 8) == 0;
+#endif
+}
+
 #endif // HASHSET_IMPLEMENTATION
 
 
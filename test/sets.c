@@ -0,0 +1,686 @@
+// SPDX-License-Identifier: MIT
+//
+// Checks each layout of set against a reference model: random calls
+// on keys from a small range, so that they collide and come back
+// after being removed, each compared with an array that says which
+// keys are in the set. The calls come in phases that mostly insert
+// or mostly remove, so the tables grow and shrink several times.
+//
+// "make test" builds this once per configuration, like the _bg
+// benchmarks, with the sanitizers on. A failed check prints its line
+// and the seed, and exits with 1.
+//
+// Usage: sets [-n calls] [-s seed]
+
+#include "../hashset.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TEST_KEYS  4096  // keys are taken in [0, TEST_KEYS)
+#define TEST_PHASE 16384 // calls before switching between phases
+
+#define CHECK(cond)                                                     \
+  do {                                                                  \
+    if (!(cond))                                                        \
+    {                                                                   \
+      fprintf(stderr, "%s:%d: check failed: %s (seed %llu)\n",          \
+              __FILE__, __LINE__, #cond, (unsigned long long) seed);    \
+      exit(1);                                                          \
+    }                                                                   \
+  } while (0)
+
+static uint64_t seed = 1;
+
+// Which keys are in the set under test, and how many
+typedef struct {
+  bool in[TEST_KEYS];
+  size_t size;
+} reference;
+
+static void ref_set(reference *ref, uint32_t key, bool in)
+{
+  if (ref->in[key] == in) return;
+  ref->in[key] = in;
+  if (in) ref->size++;
+  else ref->size--;
+}
+
+// A call to make: [op] picks the function, [variant] which flavour of
+// it and [key] its argument. Inserts are more likely in the even
+// phases and removals in the odd ones.
+typedef struct {
+  unsigned int op;
+  unsigned int variant; // in [0, 8)
+  uint32_t key;
+} call;
+
+enum { OP_INSERT, OP_CONTAINS, OP_REMOVE };
+
+static call next_call(uint64_t *rng, size_t i)
+{
+  uint64_t r = hashset_rand(rng);
+  call c = {.key = (uint32_t) (r >> 32) % TEST_KEYS};
+  unsigned int dice = (unsigned int) (r & 0xff) % 10;
+  bool growing = (i / TEST_PHASE) % 2 == 0;
+  if (dice < 2) c.op = OP_CONTAINS;
+  else if (dice < 9) c.op = growing ? OP_INSERT : OP_REMOVE;
+  else c.op = growing ? OP_REMOVE : OP_INSERT;
+  c.variant = (unsigned int) (r >> 8) & 7;
+  return c;
+}
+
+static hashset_hash_t test_hash(uint32_t key, unsigned int key_len)
+{
+  (void) key_len;
+  return (hashset_hash_t) hashset_hash_bytes(&key, sizeof(key));
+}
+
+static bool test_eq(uint32_t a, unsigned int a_len,
+                    uint32_t b, unsigned int b_len)
+{
+  (void) a_len;
+  (void) b_len;
+  return a == b;
+}
+
+HASHSET_DECLARE(u32, uint32_t, test_hash, test_eq)
+
+//
+// HASHSET_DECLARE
+//
+
+// Keys of [ref] missing from [set], up to [max]
+static size_t missing_keys(reference *ref, uint64_t *rng,
+                           uint32_t *keys, size_t max)
+{
+  size_t n = 0;
+  uint32_t key = (uint32_t) hashset_rand(rng) % TEST_KEYS;
+  for (size_t i = 0; i < TEST_KEYS && n < max; ++i)
+  {
+    uint32_t k = (key + (uint32_t) i) % TEST_KEYS;
+    if (!ref->in[k]) keys[n++] = k;
+  }
+  return n;
+}
+
+// Keys erased by erase_if: those congruent to *ctx modulo 7
+static bool erase_pred(uint32_t key, unsigned int key_len, void *ctx)
+{
+  (void) key_len;
+  return key % 7 == *(uint32_t *) ctx;
+}
+
+static size_t ref_erase(reference *ref, uint32_t rest)
+{
+  size_t n = 0;
+  for (uint32_t key = rest; key < TEST_KEYS; key += 7)
+    if (ref->in[key])
+    {
+      ref_set(ref, key, false);
+      n++;
+    }
+  return n;
+}
+
+// Pops every key of [set], checking each one against [ref]
+static void drain_u32_set(u32_set *set, reference *ref)
+{
+  uint32_t key;
+  uint64_t rng = seed;
+  while (ref->size > 0)
+  {
+    CHECK(u32_set_pop(set, &key, NULL));
+    CHECK(key < TEST_KEYS && ref->in[key]);
+    ref_set(ref, key, false);
+    CHECK(set->size == ref->size);
+  }
+  CHECK(!u32_set_pop(set, &key, NULL));
+  CHECK(!u32_set_sample(set, &rng, &key, NULL));
+}
+
+static void check_u32_set(u32_set *set, reference *ref)
+{
+  CHECK(set->size == ref->size);
+  for (uint32_t key = 0; key < TEST_KEYS; ++key)
+    CHECK(u32_set_contains(set, key, 0) == ref->in[key]);
+}
+
+static void test_value(size_t calls)
+{
+  uint64_t rng = seed;
+  reference ref = {0};
+  u32_set set;
+  CHECK(u32_set_init(&set) == HASHSET_OK);
+
+  for (size_t i = 0; i < calls; ++i)
+  {
+    call c = next_call(&rng, i);
+    uint32_t keys[8];
+    uint32_t key;
+    size_t n;
+    if (i % (4 * TEST_PHASE) == 4 * TEST_PHASE - 1)
+      drain_u32_set(&set, &ref);
+    switch (c.op)
+    {
+    case OP_INSERT:
+      if (c.variant == 0)
+      {
+        // Batches of distinct keys not in the set
+        n = missing_keys(&ref, &rng, keys, c.key % 8 + 1);
+        CHECK(u32_set_insert_unique_batch(&set, keys, NULL, n)
+              == HASHSET_OK);
+        for (size_t j = 0; j < n; ++j) ref_set(&ref, keys[j], true);
+      }
+      else if (c.variant == 1 && !ref.in[c.key])
+      {
+        CHECK(u32_set_insert_unique(&set, c.key, 0));
+        ref_set(&ref, c.key, true);
+      }
+      else
+      {
+        CHECK(u32_set_insert(&set, c.key, 0) == !ref.in[c.key]);
+        ref_set(&ref, c.key, true);
+      }
+      break;
+    case OP_CONTAINS:
+      if (c.variant == 0)
+      {
+        CHECK(u32_set_sample(&set, &rng, &key, NULL) == (ref.size > 0));
+        CHECK(ref.size == 0 || (key < TEST_KEYS && ref.in[key]));
+      }
+      else
+        CHECK(u32_set_contains(&set, c.key, 0) == ref.in[c.key]);
+      break;
+    case OP_REMOVE:
+      if (c.variant == 0)
+      {
+        // Batches of any keys, present or not, maybe repeated
+        size_t removed = 0;
+        n = c.key % 8 + 1;
+        for (size_t j = 0; j < n; ++j)
+        {
+          keys[j] = (uint32_t) hashset_rand(&rng) % TEST_KEYS;
+          removed += ref.in[keys[j]];
+          ref_set(&ref, keys[j], false);
+        }
+        CHECK(u32_set_remove_batch(&set, keys, NULL, n) == removed);
+      }
+      else if (c.variant == 1 && c.key % 64 == 0)
+      {
+        // A whole pass over the table, keep it rare
+        uint32_t rest = c.key / 64 % 7;
+        CHECK(u32_set_erase_if(&set, erase_pred, &rest)
+              == ref_erase(&ref, rest));
+      }
+      else if (c.variant == 2)
+      {
+        CHECK(u32_set_pop(&set, &key, NULL) == (ref.size > 0));
+        CHECK(ref.size == 0 || (key < TEST_KEYS && ref.in[key]));
+        if (ref.size > 0) ref_set(&ref, key, false);
+      }
+      else
+      {
+        CHECK(u32_set_remove(&set, c.key, 0) == ref.in[c.key]);
+        ref_set(&ref, c.key, false);
+      }
+      break;
+    }
+    CHECK(set.size == ref.size);
+  }
+
+  check_u32_set(&set, &ref);
+  u32_set_destroy(&set);
+}
+
+#ifdef HASHSET_ADAPTIVE_LOAD
+
+// Runs of 16 keys share a hash, so lookups probe far
+static hashset_hash_t clump_hash(uint32_t key, unsigned int key_len)
+{
+  return test_hash(key / 16, key_len);
+}
+
+HASHSET_DECLARE(clump, uint32_t, clump_hash, test_eq)
+
+// A set whose lookups probe far grows at a lower load than one with a
+// good hash, and neither goes past HASHSET_ADAPTIVE_MAX_LOAD
+static void test_adaptive(void)
+{
+  u32_set good;
+  clump_set bad;
+  CHECK(u32_set_init(&good) == HASHSET_OK);
+  CHECK(clump_set_init(&bad) == HASHSET_OK);
+
+  double good_load = 0, bad_load = 0;
+  for (uint32_t key = 0; key < 8 * TEST_KEYS; ++key)
+  {
+    size_t good_cap = good.capacity, bad_cap = bad.capacity;
+    CHECK(u32_set_insert(&good, key, 0));
+    CHECK(clump_set_insert(&bad, key, 0));
+    // The load each set grew at
+    if (good.capacity != good_cap)
+      good_load = (double) (good.size - 1) / good_cap;
+    if (bad.capacity != bad_cap)
+      bad_load = (double) (bad.size - 1) / bad_cap;
+    CHECK(good.size - 1 <= good.capacity * HASHSET_ADAPTIVE_MAX_LOAD);
+    CHECK(bad.size - 1 <= bad.capacity * HASHSET_ADAPTIVE_MAX_LOAD);
+
+    // A hit and a miss per insert
+    CHECK(u32_set_contains(&good, key / 2, 0));
+    CHECK(!u32_set_contains(&good, key + 1, 0));
+    CHECK(clump_set_contains(&bad, key / 2, 0));
+    CHECK(!clump_set_contains(&bad, key + 1, 0));
+  }
+  CHECK(bad_load < good_load);
+  CHECK(bad_load >= HASHSET_ADAPTIVE_MIN_LOAD - 0.01);
+
+  // The statistics start over with each table
+  CHECK(u32_set_resize(&good, good.capacity * 2) == HASHSET_OK);
+  CHECK(good.adaptive.hits.lookups == 0);
+  CHECK(good.adaptive.misses.average == 0);
+
+  u32_set_destroy(&good);
+  clump_set_destroy(&bad);
+}
+
+#endif // HASHSET_ADAPTIVE_LOAD
+
+#ifdef HASHSET_MIN_LOAD_FACTOR
+
+// Emptying a set shrinks it back, dropping its tombstones, and keys
+// that come and go at the load it shrank at do not resize it again
+static void test_shrink(void)
+{
+  u32_set set;
+  CHECK(u32_set_init(&set) == HASHSET_OK);
+  for (uint32_t key = 0; key < 8 * TEST_KEYS; ++key)
+    CHECK(u32_set_insert(&set, key, 0));
+  size_t full = set.capacity;
+
+  for (uint32_t key = 0; key < 8 * TEST_KEYS; ++key)
+  {
+    size_t capacity = set.capacity;
+    CHECK(u32_set_remove(&set, key, 0));
+    CHECK(set.capacity >= HASHSET_INITIAL_CAPACITY);
+    if (set.capacity == capacity) continue;
+
+    // Shrunk, to a load it does not grow back from right away
+    double load = (double) set.size / set.capacity;
+    CHECK(set.capacity < capacity);
+    CHECK(load <= HASHSET_GROW_LOAD / 2);
+    for (size_t i = 0; i < set.capacity; ++i)
+      CHECK(set.state[i] != 2);
+    capacity = set.capacity;
+    for (int i = 0; i < 64; ++i)
+    {
+      CHECK(u32_set_insert(&set, key, 0));
+      CHECK(u32_set_remove(&set, key, 0));
+    }
+    CHECK(set.capacity == capacity);
+  }
+  CHECK(set.size == 0);
+  CHECK(set.capacity < full);
+  CHECK(set.capacity == HASHSET_INITIAL_CAPACITY);
+  u32_set_destroy(&set);
+}
+
+#endif // HASHSET_MIN_LOAD_FACTOR
+
+//
+// HASHSET_DECLARE_REF
+//
+
+// A key too large to pass by value, equal by name only
+typedef struct {
+  char name[24];
+  uint32_t id;
+} record;
+
+static record record_of(uint32_t key)
+{
+  record r = {.id = key};
+  snprintf(r.name, sizeof(r.name), "record %u", (unsigned int) key);
+  return r;
+}
+
+static hashset_hash_t record_hash(const record *r, unsigned int len)
+{
+  (void) len;
+  return (hashset_hash_t) hashset_hash_bytes(r->name, strlen(r->name));
+}
+
+static bool record_eq(const record *a, unsigned int a_len,
+                      const record *b, unsigned int b_len)
+{
+  (void) a_len;
+  (void) b_len;
+  return strcmp(a->name, b->name) == 0;
+}
+
+HASHSET_DECLARE_REF(rec, record, record_hash, record_eq)
+
+static void test_ref(size_t calls)
+{
+  uint64_t rng = seed;
+  reference ref = {0};
+  rec_set set;
+  CHECK(rec_set_init(&set) == HASHSET_OK);
+
+  for (size_t i = 0; i < calls; ++i)
+  {
+    call c = next_call(&rng, i);
+    record key = record_of(c.key);
+    switch (c.op)
+    {
+    case OP_INSERT:
+      CHECK(rec_set_insert(&set, &key, 0) == !ref.in[c.key]);
+      ref_set(&ref, c.key, true);
+      break;
+    case OP_CONTAINS:
+      CHECK(rec_set_contains(&set, &key, 0) == ref.in[c.key]);
+      break;
+    case OP_REMOVE:
+      CHECK(rec_set_remove(&set, &key, 0) == ref.in[c.key]);
+      ref_set(&ref, c.key, false);
+      break;
+    }
+    CHECK(set.size == ref.size);
+  }
+
+  // The stored keys are copies, whole
+  record r;
+  while (rec_set_pop(&set, &r, NULL))
+  {
+    CHECK(r.id < TEST_KEYS && ref.in[r.id]);
+    CHECK(strcmp(r.name, record_of(r.id).name) == 0);
+    ref_set(&ref, r.id, false);
+  }
+  CHECK(ref.size == 0);
+  rec_set_destroy(&set);
+}
+
+//
+// HASHSET_DECLARE_POD
+//
+
+// 20 bytes, not a multiple of the 8 the hash reads at a time, and
+// keys differ only in the last ones
+typedef struct {
+  uint32_t words[5];
+} triple;
+
+static triple triple_of(uint32_t key)
+{
+  return (triple) {{0xdeadbeef, 1, 2, 3, key}};
+}
+
+HASHSET_DECLARE_POD(pod, triple)
+
+static void test_pod(size_t calls)
+{
+  uint64_t rng = seed;
+  reference ref = {0};
+  pod_set set;
+  CHECK(pod_set_init(&set) == HASHSET_OK);
+
+  for (size_t i = 0; i < calls; ++i)
+  {
+    call c = next_call(&rng, i);
+    triple key = triple_of(c.key);
+    switch (c.op)
+    {
+    case OP_INSERT:
+      CHECK(pod_set_insert(&set, &key, 0) == !ref.in[c.key]);
+      ref_set(&ref, c.key, true);
+      break;
+    case OP_CONTAINS:
+      CHECK(pod_set_contains(&set, &key, 0) == ref.in[c.key]);
+      break;
+    case OP_REMOVE:
+      CHECK(pod_set_remove(&set, &key, 0) == ref.in[c.key]);
+      ref_set(&ref, c.key, false);
+      break;
+    }
+    CHECK(set.size == ref.size);
+  }
+
+  for (uint32_t k = 0; k < TEST_KEYS; ++k)
+  {
+    triple key = triple_of(k);
+    CHECK(pod_set_contains(&set, &key, 0) == ref.in[k]);
+  }
+  pod_set_destroy(&set);
+}
+
+//
+// HASHSET_DECLARE_U128
+//
+
+HASHSET_DECLARE_U128(u128)
+
+// Key 0 is all zeros
+static hashset_u128 u128_of(uint32_t key)
+{
+  return (hashset_u128) {.lo = key * 0x9e3779b97f4a7c15ULL, .hi = key};
+}
+
+static void test_u128(size_t calls)
+{
+  uint64_t rng = seed;
+  reference ref = {0};
+  u128_set set;
+  CHECK(u128_set_init(&set) == HASHSET_OK);
+
+  for (size_t i = 0; i < calls; ++i)
+  {
+    call c = next_call(&rng, i);
+    hashset_u128 key = u128_of(c.key);
+    switch (c.op)
+    {
+    case OP_INSERT:
+      CHECK(u128_set_insert(&set, key) == !ref.in[c.key]);
+      ref_set(&ref, c.key, true);
+      break;
+    case OP_CONTAINS:
+      CHECK(u128_set_contains(&set, key) == ref.in[c.key]);
+      break;
+    case OP_REMOVE:
+      CHECK(u128_set_remove(&set, key) == ref.in[c.key]);
+      ref_set(&ref, c.key, false);
+      break;
+    }
+    CHECK(set.size == ref.size);
+  }
+
+  for (uint32_t k = 0; k < TEST_KEYS; ++k)
+    CHECK(u128_set_contains(&set, u128_of(k)) == ref.in[k]);
+  u128_set_destroy(&set);
+}
+
+//
+// HASHSET_DECLARE_POINTER
+//
+
+HASHSET_DECLARE_POINTER(ptr)
+
+// The keys are the addresses of these
+static uint64_t objects[TEST_KEYS];
+
+static void test_pointer(size_t calls)
+{
+  uint64_t rng = seed;
+  reference ref = {0};
+  ptr_set set;
+  CHECK(ptr_set_init(&set) == HASHSET_OK);
+  CHECK(!ptr_set_insert(&set, NULL));
+
+  for (size_t i = 0; i < calls; ++i)
+  {
+    call c = next_call(&rng, i);
+    const void *key = &objects[c.key];
+    switch (c.op)
+    {
+    case OP_INSERT:
+      CHECK(ptr_set_insert(&set, key) == !ref.in[c.key]);
+      ref_set(&ref, c.key, true);
+      break;
+    case OP_CONTAINS:
+      CHECK(ptr_set_contains(&set, key) == ref.in[c.key]);
+      break;
+    case OP_REMOVE:
+      CHECK(ptr_set_remove(&set, key) == ref.in[c.key]);
+      ref_set(&ref, c.key, false);
+      break;
+    }
+    CHECK(set.size == ref.size);
+  }
+
+  for (uint32_t k = 0; k < TEST_KEYS; ++k)
+    CHECK(ptr_set_contains(&set, &objects[k]) == ref.in[k]);
+  CHECK(!ptr_set_contains(&set, NULL));
+  ptr_set_destroy(&set);
+}
+
+//
+// HASHSET_DECLARE_PERSISTENT
+//
+
+#define TEST_SNAPSHOTS 4    // versions kept at a time
+#define TEST_SNAPSHOT  1024 // calls between two snapshots
+
+// With weak_hash, keys share their hash with many others, and the
+// trie goes down to the nodes that only hold equal hashes
+static bool weak_hash;
+
+static hashset_hash_t pset_hash(uint32_t key, unsigned int key_len)
+{
+  return weak_hash ? key % 61 : test_hash(key, key_len);
+}
+
+HASHSET_DECLARE_PERSISTENT(u32, uint32_t, pset_hash, test_eq)
+
+static void check_u32_pset(u32_pset *set, reference *ref)
+{
+  CHECK(u32_pset_size(set) == ref->size);
+  for (uint32_t key = 0; key < TEST_KEYS; ++key)
+    CHECK(u32_pset_contains(set, key, 0) == ref->in[key]);
+}
+
+// Snapshots are taken along the way, and kept with a copy of the
+// reference. Some get inserts of their own, which must not show in
+// the other versions they share nodes with.
+static void test_persistent(size_t calls)
+{
+  static reference refs[TEST_SNAPSHOTS];
+  u32_pset snapshots[TEST_SNAPSHOTS];
+  size_t nsnapshots = 0;
+  uint64_t rng = seed;
+  reference ref = {0};
+  u32_pset set;
+  CHECK(u32_pset_init(&set) == HASHSET_OK);
+
+  for (size_t i = 0; i < calls; ++i)
+  {
+    call c = next_call(&rng, i);
+    uint32_t keys[8];
+    size_t n, s = c.key % TEST_SNAPSHOTS;
+    if (i % TEST_SNAPSHOT == 0)
+    {
+      if (nsnapshots == TEST_SNAPSHOTS)
+      {
+        // Replace the oldest
+        s = i / TEST_SNAPSHOT % TEST_SNAPSHOTS;
+        check_u32_pset(&snapshots[s], &refs[s]);
+        u32_pset_destroy(&snapshots[s]);
+      }
+      else
+        s = nsnapshots++;
+      snapshots[s] = u32_pset_snapshot(&set);
+      refs[s] = ref;
+    }
+    switch (c.op)
+    {
+    case OP_INSERT:
+      if (c.variant == 0)
+      {
+        // Batches of any keys, maybe repeated
+        n = c.key % 8 + 1;
+        for (size_t j = 0; j < n; ++j)
+        {
+          keys[j] = (uint32_t) hashset_rand(&rng) % TEST_KEYS;
+          ref_set(&ref, keys[j], true);
+        }
+        CHECK(u32_pset_insert_batch(&set, keys, NULL, n)
+              == HASHSET_OK);
+      }
+      else if (c.variant == 1 && s < nsnapshots)
+      {
+        CHECK(u32_pset_insert(&snapshots[s], c.key, 0)
+              == !refs[s].in[c.key]);
+        ref_set(&refs[s], c.key, true);
+      }
+      else
+      {
+        CHECK(u32_pset_insert(&set, c.key, 0) == !ref.in[c.key]);
+        ref_set(&ref, c.key, true);
+      }
+      break;
+    case OP_CONTAINS:
+      CHECK(u32_pset_contains(&set, c.key, 0) == ref.in[c.key]);
+      break;
+    case OP_REMOVE:
+      CHECK(u32_pset_remove(&set, c.key, 0) == ref.in[c.key]);
+      ref_set(&ref, c.key, false);
+      break;
+    }
+    CHECK(u32_pset_size(&set) == ref.size);
+  }
+
+  check_u32_pset(&set, &ref);
+  u32_pset_destroy(&set);
+  for (size_t s = 0; s < nsnapshots; ++s)
+  {
+    check_u32_pset(&snapshots[s], &refs[s]);
+    u32_pset_destroy(&snapshots[s]);
+  }
+}
+
+static int usage(const char *prog)
+{
+  fprintf(stderr, "Usage: %s [-n calls] [-s seed]\n", prog);
+  return 1;
+}
+
+int main(int argc, char **argv)
+{
+  size_t calls = 200000;
+  for (int i = 1; i < argc; ++i)
+  {
+    if (!strcmp(argv[i], "-n") && i + 1 < argc)
+      calls = strtoul(argv[++i], NULL, 10);
+    else if (!strcmp(argv[i], "-s") && i + 1 < argc)
+      seed = strtoull(argv[++i], NULL, 10);
+    else
+      return usage(argv[0]);
+  }
+
+  test_value(calls);
+#ifdef HASHSET_ADAPTIVE_LOAD
+  test_adaptive();
+#endif
+#ifdef HASHSET_MIN_LOAD_FACTOR
+  test_shrink();
+#endif
+  test_ref(calls);
+  test_pod(calls);
+  test_u128(calls);
+  test_pointer(calls);
+  test_persistent(calls);
+  weak_hash = true;
+  test_persistent(calls);
+  printf("%s: ok, %zu calls per layout, seed %llu\n", argv[0], calls,
+         (unsigned long long) seed);
+  return 0;
+}
@@ -0,0 +1,306 @@
+// SPDX-License-Identifier: MIT
+//
+// Checks the thread safe ways to use a set: several threads call the
+// same set at once, each on keys that only it changes and so knows
+// the state of, while they all look up a range of keys that nobody
+// changes. The set left behind is then compared with what the
+// threads did. Sets merged with prefix_set_merge_many are compared
+// with the union of their keys.
+//
+// "make test" builds this with ThreadSanitizer, which also reports
+// the data races the results would not show.
+//
+// Usage: threads [-n calls] [-t threads] [-s seed]
+
+#define _POSIX_C_SOURCE 200809L
+#define HASHSET_THREADS
+#include "../hashset.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TEST_MAX_THREADS 16
+#define TEST_KEYS        2048 // keys changed by each thread
+#define TEST_SHARED      1024 // keys inserted before the threads start
+#define TEST_RACED       8192 // keys all the threads try to insert
+#define TEST_MERGED      16384 // keys of the merged sets
+
+#define CHECK(cond)                                                     \
+  do {                                                                  \
+    if (!(cond))                                                        \
+    {                                                                   \
+      fprintf(stderr, "%s:%d: check failed: %s (seed %llu)\n",          \
+              __FILE__, __LINE__, #cond, (unsigned long long) seed);    \
+      exit(1);                                                          \
+    }                                                                   \
+  } while (0)
+
+static uint64_t seed = 1;
+static size_t calls = 100000;
+static size_t nthreads = 4;
+
+// Key [i] of thread [t], the shared keys are those of thread
+// nthreads
+static uint64_t thread_key(size_t t, size_t i)
+{
+  return (uint64_t) i * (TEST_MAX_THREADS + 1) + t;
+}
+
+static hashset_hash_t test_hash(uint64_t key, unsigned int key_len)
+{
+  (void) key_len;
+  return (hashset_hash_t) hashset_hash_bytes(&key, sizeof(key));
+}
+
+static bool test_eq(uint64_t a, unsigned int a_len,
+                    uint64_t b, unsigned int b_len)
+{
+  (void) a_len;
+  (void) b_len;
+  return a == b;
+}
+
+HASHSET_DECLARE(u64, uint64_t, test_hash, test_eq)
+HASHSET_DECLARE_FLAT_COMBINING(u64, uint64_t)
+HASHSET_DECLARE_GROW_ONLY(u64, uint64_t, test_hash, test_eq)
+
+// What a thread did: in[i] tells whether its key i is in the set, and
+// won[i] whether it inserted the raced key i
+typedef struct {
+  pthread_t thread;
+  size_t id;
+  bool in[TEST_KEYS];
+  bool won[TEST_RACED];
+  void *set;
+} worker;
+
+static void run_workers(worker *workers, void *(*fn)(void *), void *set)
+{
+  for (size_t t = 0; t < nthreads; ++t)
+  {
+    memset(&workers[t], 0, sizeof(workers[t]));
+    workers[t].id = t;
+    workers[t].set = set;
+    CHECK(pthread_create(&workers[t].thread, NULL, fn, &workers[t])
+          == 0);
+  }
+  for (size_t t = 0; t < nthreads; ++t)
+    CHECK(pthread_join(workers[t].thread, NULL) == 0);
+}
+
+//
+// HASHSET_DECLARE_FLAT_COMBINING
+//
+
+static void *fc_worker(void *arg)
+{
+  worker *w = arg;
+  u64_fc_set *fc = w->set;
+  int slot = u64_fc_set_register(fc);
+  CHECK(slot >= 0);
+
+  uint64_t rng = seed + w->id;
+  for (size_t i = 0; i < calls; ++i)
+  {
+    uint64_t r = hashset_rand(&rng);
+    size_t k = (size_t) (r >> 32) % TEST_KEYS;
+    uint64_t key = thread_key(w->id, k);
+    switch (r % 4)
+    {
+    case 0:
+      CHECK(u64_fc_set_insert(fc, slot, key, 0) == !w->in[k]);
+      w->in[k] = true;
+      break;
+    case 1:
+      CHECK(u64_fc_set_remove(fc, slot, key, 0) == w->in[k]);
+      w->in[k] = false;
+      break;
+    case 2:
+      CHECK(u64_fc_set_contains(fc, slot, key, 0) == w->in[k]);
+      break;
+    default:
+      key = thread_key(nthreads, k % TEST_SHARED);
+      CHECK(u64_fc_set_contains(fc, slot, key, 0));
+    }
+  }
+  return NULL;
+}
+
+static void test_fc(void)
+{
+  static worker workers[TEST_MAX_THREADS];
+  u64_fc_set *fc;
+  CHECK(posix_memalign((void **) &fc, 64, sizeof(*fc)) == 0);
+  CHECK(u64_fc_set_init(fc) == HASHSET_OK);
+  for (size_t i = 0; i < TEST_SHARED; ++i)
+    CHECK(u64_set_insert(&fc->set, thread_key(nthreads, i), 0));
+
+  run_workers(workers, fc_worker, fc);
+
+  size_t size = TEST_SHARED;
+  for (size_t t = 0; t < nthreads; ++t)
+    for (size_t k = 0; k < TEST_KEYS; ++k)
+    {
+      CHECK(u64_set_contains(&fc->set, thread_key(t, k), 0)
+            == workers[t].in[k]);
+      size += workers[t].in[k];
+    }
+  CHECK(fc->set.size == size);
+  u64_fc_set_destroy(fc);
+  free(fc);
+}
+
+//
+// HASHSET_DECLARE_GROW_ONLY
+//
+
+// Raced keys are those of thread TEST_MAX_THREADS
+static void *gset_worker(void *arg)
+{
+  worker *w = arg;
+  u64_gset *set = w->set;
+
+  uint64_t rng = seed + w->id;
+  for (size_t i = 0; i < calls; ++i)
+  {
+    uint64_t r = hashset_rand(&rng);
+    size_t k = (size_t) (r >> 32) % TEST_KEYS;
+    uint64_t key = thread_key(w->id, k);
+    size_t raced = (size_t) (r >> 32) % TEST_RACED;
+    uint64_t raced_key = thread_key(TEST_MAX_THREADS, raced);
+    int ret;
+    switch (r % 4)
+    {
+    case 0:
+    case 1:
+      ret = u64_gset_test_and_insert(set, raced_key, 0);
+      CHECK(ret == 0 || ret == 1);
+      CHECK(ret == 1 || !w->won[raced]);
+      if (ret == 0) w->won[raced] = true;
+      break;
+    case 2:
+      CHECK(u64_gset_insert(set, key, 0) == !w->in[k]);
+      w->in[k] = true;
+      break;
+    default:
+      CHECK(u64_gset_contains(set, key, 0) == w->in[k]);
+      CHECK(!w->won[raced] || u64_gset_contains(set, raced_key, 0));
+    }
+  }
+  return NULL;
+}
+
+static void test_gset(void)
+{
+  static worker workers[TEST_MAX_THREADS];
+  u64_gset set;
+  CHECK(u64_gset_init(&set) == HASHSET_OK);
+
+  run_workers(workers, gset_worker, &set);
+
+  // Each raced key was inserted by one thread at most
+  size_t size = 0;
+  for (size_t k = 0; k < TEST_RACED; ++k)
+  {
+    size_t winners = 0;
+    for (size_t t = 0; t < nthreads; ++t)
+      winners += workers[t].won[k];
+    CHECK(winners <= 1);
+    CHECK(u64_gset_contains(&set, thread_key(TEST_MAX_THREADS, k), 0)
+          == (winners == 1));
+    size += winners;
+  }
+  for (size_t t = 0; t < nthreads; ++t)
+    for (size_t k = 0; k < TEST_KEYS; ++k)
+    {
+      CHECK(u64_gset_contains(&set, thread_key(t, k), 0)
+            == workers[t].in[k]);
+      size += workers[t].in[k];
+    }
+  CHECK(u64_gset_size(&set) == size);
+  u64_gset_destroy(&set);
+}
+
+//
+// prefix_set_merge_many
+//
+
+// Fills [set] with random keys of the merge, some then removed to
+// leave tombstones, and marks those it keeps in [in]
+static void fill_merged(u64_set *set, bool *in, uint64_t *rng)
+{
+  CHECK(u64_set_init(set) == HASHSET_OK);
+  for (size_t i = 0; i < TEST_MERGED / 4; ++i)
+  {
+    uint64_t key = hashset_rand(rng) % TEST_MERGED;
+    u64_set_insert(set, key, 0);
+  }
+  for (size_t i = 0; i < TEST_MERGED / 16; ++i)
+    u64_set_remove(set, hashset_rand(rng) % TEST_MERGED, 0);
+  for (uint64_t key = 0; key < TEST_MERGED; ++key)
+    if (u64_set_contains(set, key, 0)) in[key] = true;
+}
+
+static void test_merge(size_t merge_threads)
+{
+  static bool in[TEST_MERGED];
+  static u64_set sets[TEST_MAX_THREADS];
+  u64_set *srcs[TEST_MAX_THREADS];
+  u64_set dst;
+  uint64_t rng = seed + merge_threads;
+  memset(in, 0, sizeof(in));
+
+  fill_merged(&dst, in, &rng);
+  for (size_t t = 0; t < nthreads; ++t)
+  {
+    fill_merged(&sets[t], in, &rng);
+    srcs[t] = &sets[t];
+  }
+  CHECK(u64_set_merge_many(&dst, srcs, nthreads, merge_threads)
+        == HASHSET_OK);
+
+  size_t size = 0;
+  for (uint64_t key = 0; key < TEST_MERGED; ++key)
+  {
+    CHECK(u64_set_contains(&dst, key, 0) == in[key]);
+    size += in[key];
+  }
+  CHECK(dst.size == size);
+  u64_set_destroy(&dst);
+  for (size_t t = 0; t < nthreads; ++t)
+    u64_set_destroy(&sets[t]);
+}
+
+static int usage(const char *prog)
+{
+  fprintf(stderr, "Usage: %s [-n calls] [-t threads] [-s seed]\n",
+          prog);
+  return 1;
+}
+
+int main(int argc, char **argv)
+{
+  for (int i = 1; i < argc; ++i)
+  {
+    if (!strcmp(argv[i], "-n") && i + 1 < argc)
+      calls = strtoul(argv[++i], NULL, 10);
+    else if (!strcmp(argv[i], "-t") && i + 1 < argc)
+      nthreads = strtoul(argv[++i], NULL, 10);
+    else if (!strcmp(argv[i], "-s") && i + 1 < argc)
+      seed = strtoull(argv[++i], NULL, 10);
+    else
+      return usage(argv[0]);
+  }
+  if (nthreads < 1 || nthreads > TEST_MAX_THREADS)
+    return usage(argv[0]);
+
+  test_fc();
+  test_gset();
+  test_merge(1);
+  test_merge(nthreads);
+  test_merge(TEST_MAX_THREADS);
+  printf("%s: ok, %zu threads of %zu calls, seed %llu\n", argv[0],
+         nthreads, calls, (unsigned long long) seed);
+  return 0;
+}